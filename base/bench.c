@@ -0,0 +1,453 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Authors: Pietje Bell <pietjebell@pietjebell.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Runs the encoders and checksums over synthetic input and prints
+ * what they manage as JSON on stdout, one result per kernel, dispatch
+ * path, kind of input and buffer size.  Built and run by "make bench";
+ * the optional argument is the minimum number of seconds to spend on
+ * each result (default 0.1). */
+
+#include "newspost.h"
+#include "../enc/yencode.h"
+#include "../enc/uuencode.h"
+#include "../cksfv/sfv.h"
+#include "../parchive/types.h"
+#include "../parchive/fileops.h"
+#include "../parchive/rs.h"
+#include "../parchive/md5.h"
+#include "../ui/options.h"
+
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BENCH_HAVE_TSC
+#include <x86intrin.h>
+#endif
+
+#define RS_DATA_FILES 4		/* data files per recreate() run */
+#define RS_VOLUMES 2		/* parity volumes made by each run */
+
+typedef struct {
+	const char *name;
+	unsigned char *data;
+} bench_input;
+
+typedef struct {
+	double seconds;
+	double cycles;		/* -1 if there's no cycle counter */
+} bench_time;
+
+/* one run of a kernel over size bytes of in; returns FALSE on failure */
+typedef boolean (*bench_routine)(const unsigned char *in, long size,
+				 void *arg);
+
+/**
+*** Private Declarations
+**/
+
+static const long bench_sizes[] = { 4096, 65536, 1048576, 16777216 };
+#define BENCH_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+#define BENCH_MAX_SIZE 16777216
+
+static const char *yenc_paths[] =
+	{ "scalar", "sse2", "ssse3", "avx2", "avx512" };
+static const int yenc_lines[] = { YENC_LINE_LENGTH, 200 };
+static const char *uu_paths[] = { "scalar", "ssse3" };
+static const char *crc_paths[] = { "slice16", "pclmul" };
+
+#define ELEMENTS(a) (sizeof(a) / sizeof(a[0]))
+
+static double min_seconds = 0.1;
+static boolean first_result = TRUE;
+static char *outbuf = NULL;
+static const char *tmpdir = NULL;
+
+/* ui/options.c sets these for ui/main.c, which isn't linked in */
+boolean writedefaults = FALSE;
+const char *EDITOR = NULL;
+
+/* the files bench_recreate() works on, and what they were made from */
+static char *rs_data_names[RS_DATA_FILES];
+static char *rs_volume_names[RS_VOLUMES];
+static const unsigned char *rs_input = NULL;
+static long rs_size = 0;
+
+static void make_inputs(bench_input *inputs);
+static void run(const char *kernel, const char *path, int line,
+		const bench_input *input, long size,
+		bench_routine routine, void *arg);
+static bench_time now();
+static void report(const char *kernel, const char *path, int line,
+		   const char *input, long size, long runs,
+		   bench_time elapsed);
+
+static boolean bench_yencode(const unsigned char *in, long size, void *arg);
+static boolean bench_uu_encode(const unsigned char *in, long size,
+			       void *arg);
+static boolean bench_crc32(const unsigned char *in, long size, void *arg);
+static boolean bench_md5(const unsigned char *in, long size, void *arg);
+static boolean bench_recreate(const unsigned char *in, long size,
+			      void *arg);
+
+static boolean make_rs_files(const unsigned char *in, long size);
+static void remove_rs_files();
+static char *write_temp_file(const unsigned char *data, long size);
+
+/**
+*** Main
+**/
+
+int main(int argc, char **argv)
+{
+	bench_input inputs[4];
+	int i, j, k;
+	unsigned int s;
+	FILE *md5file;
+	char *md5name;
+
+	if (argc > 1)
+		min_seconds = atof(argv[1]);
+	if (min_seconds <= 0)
+		min_seconds = 0.1;
+
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL)
+		tmpdir = "/tmp";
+
+	make_inputs(inputs);
+	outbuf = malloc(BENCH_MAX_SIZE * 2 + BENCH_MAX_SIZE / 32 + 1024);
+
+	printf("{\n  \"min_seconds\": %g,\n  \"results\": [", min_seconds);
+
+	for (i = 0; i < ELEMENTS(yenc_paths); i++) {
+		if (!yenc_use_kernel(yenc_paths[i]))
+			continue;
+		for (k = 0; k < ELEMENTS(yenc_lines); k++)
+			for (j = 0; j < ELEMENTS(inputs); j++)
+				for (s = 0; s < BENCH_SIZES; s++)
+					run("yencode", yenc_paths[i],
+					    yenc_lines[k], &inputs[j],
+					    bench_sizes[s], bench_yencode,
+					    (void *) &yenc_lines[k]);
+	}
+
+	for (i = 0; i < ELEMENTS(uu_paths); i++) {
+		if (!uu_use_kernel(uu_paths[i]))
+			continue;
+		for (j = 0; j < ELEMENTS(inputs); j++)
+			for (s = 0; s < BENCH_SIZES; s++)
+				run("uu_encode", uu_paths[i], 0, &inputs[j],
+				    bench_sizes[s], bench_uu_encode, NULL);
+	}
+
+	for (i = 0; i < ELEMENTS(crc_paths); i++) {
+		if (!crc32_use_kernel(crc_paths[i]))
+			continue;
+		for (j = 0; j < ELEMENTS(inputs); j++)
+			for (s = 0; s < BENCH_SIZES; s++)
+				run("crc32", crc_paths[i], 0, &inputs[j],
+				    bench_sizes[s], bench_crc32, NULL);
+	}
+
+	/* md5_stream() reads a stdio stream, so it's fed from a file
+	   that should stay in the page cache */
+	for (j = 0; j < ELEMENTS(inputs); j++)
+		for (s = 0; s < BENCH_SIZES; s++) {
+			md5name = write_temp_file(inputs[j].data,
+						  bench_sizes[s]);
+			if (md5name == NULL)
+				continue;
+			md5file = fopen(md5name, "rb");
+			if (md5file != NULL) {
+				run("md5_stream", "scalar", 0, &inputs[j],
+				    bench_sizes[s], bench_md5, md5file);
+				fclose(md5file);
+			}
+			unlink(md5name);
+			free(md5name);
+		}
+
+	for (j = 0; j < ELEMENTS(inputs); j++)
+		for (s = 0; s < BENCH_SIZES; s++)
+			run("recreate", "scalar", 0, &inputs[j],
+			    bench_sizes[s], bench_recreate, NULL);
+	remove_rs_files();
+
+	printf("\n  ]\n}\n");
+
+	free(outbuf);
+	for (j = 0; j < ELEMENTS(inputs); j++)
+		free(inputs[j].data);
+
+	return 0;
+}
+
+/**
+*** Private Routines
+**/
+
+/* random bytes, all zeroes, plain text, and bytes that yEnc has to
+ * escape every time */
+static void make_inputs(bench_input *inputs)
+{
+	static const char text[] =
+		"It was a bright cold day in April, and the clocks were "
+		"striking thirteen.\r\n";
+	static const unsigned char escapes[] =
+		{ 214, 223, 224, 227, 19 };	/* + 42 = NUL LF CR = TAB */
+	n_uint32 x = 2463534242U;
+	long i;
+	int k;
+
+	for (k = 0; k < 4; k++)
+		inputs[k].data = malloc(BENCH_MAX_SIZE);
+
+	inputs[0].name = "random";
+	inputs[1].name = "zero";
+	inputs[2].name = "text";
+	inputs[3].name = "escape";
+
+	for (i = 0; i < BENCH_MAX_SIZE; i++) {
+		/* xorshift32 */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		inputs[0].data[i] = x >> 24;
+		inputs[2].data[i] = text[i % (sizeof(text) - 1)];
+		inputs[3].data[i] = escapes[i % sizeof(escapes)];
+	}
+	memset(inputs[1].data, 0, BENCH_MAX_SIZE);
+}
+
+/* repeats the routine until it has run for min_seconds, then reports */
+static void run(const char *kernel, const char *path, int line,
+		const bench_input *input, long size,
+		bench_routine routine, void *arg)
+{
+	bench_time start, end, elapsed;
+	long runs = 0;
+
+	/* once to warm up the caches */
+	if (!routine(input->data, size, arg))
+		return;
+
+	start = now();
+	do {
+		if (!routine(input->data, size, arg))
+			return;
+		runs++;
+		end = now();
+	} while (end.seconds - start.seconds < min_seconds);
+
+	elapsed.seconds = end.seconds - start.seconds;
+	elapsed.cycles = -1;
+	if (start.cycles >= 0)
+		elapsed.cycles = end.cycles - start.cycles;
+
+	report(kernel, path, line, input->name, size, runs, elapsed);
+}
+
+/* the cycles are those of the time stamp counter, which on current
+ * CPUs ticks at a fixed rate regardless of the clock speed */
+static bench_time now()
+{
+	struct timespec ts;
+	bench_time t;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t.seconds = ts.tv_sec + ts.tv_nsec / 1e9;
+#ifdef BENCH_HAVE_TSC
+	t.cycles = __rdtsc();
+#else
+	t.cycles = -1;
+#endif
+	return t;
+}
+
+static void report(const char *kernel, const char *path, int line,
+		   const char *input, long size, long runs,
+		   bench_time elapsed)
+{
+	double bytes = (double) size * runs;
+
+	printf("%s\n    {\"kernel\": \"%s\", \"path\": \"%s\", ",
+	       first_result ? "" : ",", kernel, path);
+	if (line > 0)
+		printf("\"line\": %i, ", line);
+	printf("\"input\": \"%s\", \"size\": %li, \"runs\": %li, ",
+	       input, size, runs);
+	printf("\"mb_per_s\": %.1f, ", bytes / elapsed.seconds / 1e6);
+	if (elapsed.cycles >= 0)
+		printf("\"cycles_per_byte\": %.3f}",
+		       elapsed.cycles / bytes);
+	else
+		printf("\"cycles_per_byte\": null}");
+	fflush(stdout);
+
+	first_result = FALSE;
+}
+
+static boolean bench_yencode(const unsigned char *in, long size, void *arg)
+{
+	n_uint32 crc = 0;
+
+	yencode(in, outbuf, size, &crc, *(const int *) arg);
+	return TRUE;
+}
+
+static boolean bench_uu_encode(const unsigned char *in, long size,
+			       void *arg)
+{
+	uu_encode(in, outbuf, size);
+	return TRUE;
+}
+
+static boolean bench_crc32(const unsigned char *in, long size, void *arg)
+{
+	volatile n_uint32 crc;
+
+	crc = crc32((const char *) in, size, 0);
+	(void) crc;
+	return TRUE;
+}
+
+static boolean bench_md5(const unsigned char *in, long size, void *arg)
+{
+	FILE *file = arg;
+	md5 digest;
+
+	rewind(file);
+	return (md5_stream(file, digest) == size);
+}
+
+/* Makes RS_VOLUMES parity volumes out of RS_DATA_FILES data files
+ * that together hold size bytes, the way newspost's .par creation
+ * calls recreate(). */
+static boolean bench_recreate(const unsigned char *in, long size, void *arg)
+{
+	u16 files[RS_DATA_FILES + 1];
+	xfile_t xin[RS_DATA_FILES + 1];
+	xfile_t xout[RS_VOLUMES + 1];
+	long chunk = size / RS_DATA_FILES;
+	boolean ok;
+	int i;
+
+	if ((in != rs_input || size != rs_size) && !make_rs_files(in, size))
+		return FALSE;
+
+	for (i = 0; i < RS_DATA_FILES; i++) {
+		xin[i].size = chunk;
+		xin[i].f = file_open(unist(rs_data_names[i]), 0);
+		xin[i].filenr = i + 1;
+		xin[i].files = NULL;
+		files[i] = i + 1;
+	}
+	xin[RS_DATA_FILES].filenr = 0;
+	files[RS_DATA_FILES] = 0;
+
+	for (i = 0; i < RS_VOLUMES; i++) {
+		xout[i].size = chunk;
+		xout[i].f = file_open(unist(rs_volume_names[i]), 1);
+		xout[i].filenr = i + 1;
+		xout[i].files = files;
+	}
+	xout[RS_VOLUMES].filenr = 0;
+
+	ok = (recreate(xin, xout) != 0);
+
+	for (i = 0; i < RS_DATA_FILES; i++)
+		file_close(xin[i].f);
+	for (i = 0; i < RS_VOLUMES; i++)
+		file_close(xout[i].f);
+
+	return ok;
+}
+
+/* splits size bytes of in over the data files, and makes empty
+ * volumes for recreate() to fill */
+static boolean make_rs_files(const unsigned char *in, long size)
+{
+	long chunk = size / RS_DATA_FILES;
+	int i;
+
+	remove_rs_files();
+
+	for (i = 0; i < RS_DATA_FILES; i++) {
+		rs_data_names[i] = write_temp_file(in + i * chunk, chunk);
+		if (rs_data_names[i] == NULL)
+			return FALSE;
+	}
+	for (i = 0; i < RS_VOLUMES; i++) {
+		rs_volume_names[i] = write_temp_file(NULL, 0);
+		if (rs_volume_names[i] == NULL)
+			return FALSE;
+	}
+
+	rs_input = in;
+	rs_size = size;
+	return TRUE;
+}
+
+static void remove_rs_files()
+{
+	int i;
+
+	for (i = 0; i < RS_DATA_FILES; i++) {
+		if (rs_data_names[i] != NULL) {
+			unlink(rs_data_names[i]);
+			free(rs_data_names[i]);
+			rs_data_names[i] = NULL;
+		}
+	}
+	for (i = 0; i < RS_VOLUMES; i++) {
+		if (rs_volume_names[i] != NULL) {
+			unlink(rs_volume_names[i]);
+			free(rs_volume_names[i]);
+			rs_volume_names[i] = NULL;
+		}
+	}
+	rs_input = NULL;
+	rs_size = 0;
+}
+
+/* writes size bytes of data to a new file in tmpdir and returns its
+ * name, or NULL on failure */
+static char *write_temp_file(const unsigned char *data, long size)
+{
+	char *name;
+	int fd;
+
+	name = malloc(strlen(tmpdir) + 32);
+	sprintf(name, "%s/newspost-bench-XXXXXX", tmpdir);
+
+	fd = mkstemp(name);
+	if (fd < 0) {
+		free(name);
+		return NULL;
+	}
+	if (size > 0 && write(fd, data, size) != size) {
+		close(fd);
+		unlink(name);
+		free(name);
+		return NULL;
+	}
+	close(fd);
+	return name;
+}
@@ -0,0 +1,340 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Authors: Pietje Bell <pietjebell@pietjebell.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Checks what the articles come out as, without a server: each check
+ * prints a line saying how it went, and the exit status is the number
+ * that failed.  Built and run by "make check". */
+
+#include <stdarg.h>
+
+#include "newspost.h"
+#include "encode.h"
+#include "nntp.h"
+#include "../enc/yencode.h"
+#include "../ui/options.h"
+
+#define CHECK_FILE_SIZE 300000
+
+/**
+*** Private Declarations
+**/
+
+static const char *yenc_paths[] =
+	{ "scalar", "sse2", "ssse3", "avx2", "avx512" };
+static const int check_lines[] = { 32, 127, YENC_LINE_LENGTH, 997 };
+static const long check_sizes[] = { 0, 5000, 65536 };
+
+#define ELEMENTS(a) (sizeof(a) / sizeof(a[0]))
+
+static int failures = 0;
+
+/* ui/options.c sets these for ui/main.c, which isn't linked in */
+boolean writedefaults = FALSE;
+const char *EDITOR = NULL;
+
+static void result(boolean ok, const char *what, ...);
+static void setup(newspost_data *data, file_entry *file,
+		  const unsigned char *contents, long size);
+static long article_length(newspost_data *data, file_entry *file,
+			   int partnumber, const char *msgid,
+			   const char *date, char *buffer);
+static char *article_header(newspost_data *data, const char *msgid,
+			    const char *date);
+static int header_count(const char *header, const char *name);
+static long longest_article(const unsigned char *contents, int line,
+			    long *size, const char *msgid, const char *date);
+static void check_article_size(const unsigned char *contents);
+static void check_takethis_header();
+
+/**
+*** Public Routines
+**/
+
+int main(int argc, char **argv)
+{
+	unsigned char *contents;
+
+	contents = malloc(CHECK_FILE_SIZE);
+
+	/* 214 becomes a NUL, so every byte of this gets escaped */
+	memset(contents, 214, CHECK_FILE_SIZE);
+	check_article_size(contents);
+	free(contents);
+
+	check_takethis_header();
+
+	return failures;
+}
+
+/**
+*** Private Routines
+**/
+
+static void result(boolean ok, const char *what, ...)
+{
+	va_list ap;
+
+	printf("%s: ", (ok == TRUE) ? "ok" : "FAILED");
+	va_start(ap, what);
+	vprintf(what, ap);
+	va_end(ap);
+	printf("\n");
+
+	if (ok == FALSE)
+		failures++;
+}
+
+/* a newspost_data and file_entry as the options and the file list
+ * would leave them, with the file's contents already in memory */
+static void setup(newspost_data *data, file_entry *file,
+		  const unsigned char *contents, long size)
+{
+	memset(data, 0, sizeof(newspost_data));
+	data->from = buff_create(NULL, "Pietje Bell <pietjebell@example.org>");
+	data->newsgroup = buff_create(NULL, "alt.binaries.test");
+	data->linelength = YENC_LINE_LENGTH;
+	nntp_make_header(data);
+
+	file->filename = buff_create(NULL, "/tmp/check.bin");
+	file->fileinfo.st_size = size;
+	file->map = contents;
+}
+
+/* Lays out the article for part partnumber the way the engine sends
+ * it, and returns how many bytes that comes to. */
+static long article_length(newspost_data *data, file_entry *file,
+			   int partnumber, const char *msgid,
+			   const char *date, char *buffer)
+{
+	struct iovec iov[NNTP_ARTICLE_IOV];
+	char subject[STRING_BUFSIZE];
+	long length, total;
+	int i, n;
+
+	length = get_encoded_part(data, file, partnumber, buffer);
+	if (length < 0)
+		return -1;
+
+	sprintf(subject, "\"%s\" yEnc (%i/%i)",
+		n_basename(file->filename->data), partnumber,
+		file->number_enc_parts);
+	n = nntp_article_iov(iov, data, subject, msgid, date,
+			     buffer, length);
+
+	total = 0;
+	for (i = 0; i < n; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+/* Returns the headers of an article as they're sent, up to and
+ * including the empty line; free it afterwards. */
+static char *article_header(newspost_data *data, const char *msgid,
+			    const char *date)
+{
+	struct iovec iov[NNTP_ARTICLE_IOV];
+	char *header, *end;
+	long total;
+	int i, n;
+
+	n = nntp_article_iov(iov, data, "\"check.bin\" yEnc (1/1)", msgid,
+			     date, "body\r\n", 6);
+
+	total = 0;
+	for (i = 0; i < n; i++)
+		total += iov[i].iov_len;
+	header = malloc(total + 1);
+	total = 0;
+	for (i = 0; i < n; i++) {
+		memcpy(header + total, iov[i].iov_base, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+	header[total] = '\0';
+
+	end = strstr(header, "\r\n\r\n");
+	if (end != NULL)
+		end[4] = '\0';
+	return header;
+}
+
+/* how many of the lines in header start with name and a colon */
+static int header_count(const char *header, const char *name)
+{
+	const char *line;
+	int count = 0;
+
+	for (line = header; *line != '\0'; line = strstr(line, "\r\n") + 2) {
+		if ((strncasecmp(line, name, strlen(name)) == 0) &&
+		    (line[strlen(name)] == ':'))
+			count++;
+		if (strstr(line, "\r\n") == NULL)
+			break;
+	}
+	return count;
+}
+
+/* Encodes the whole file for articles of at most *size bytes (or the
+ * smallest there may be, put in *size, if it's 0), laid out for POST
+ * or, with a msgid, for TAKETHIS.  Returns the longest, or -1 if one
+ * couldn't be encoded. */
+static long longest_article(const unsigned char *contents, int line,
+			    long *size, const char *msgid, const char *date)
+{
+	newspost_data data;
+	file_entry *file;
+	char *buffer;
+	long length, longest;
+	int part;
+
+	file = file_entry_alloc();
+	setup(&data, file, contents, CHECK_FILE_SIZE);
+	data.linelength = line;
+	data.stream = (msgid != NULL) ? 1 : 0;
+	if (*size == 0)
+		*size = get_min_article_size(&data);
+	data.article_size = *size;
+	set_part_size(&data);
+	file->number_enc_parts = get_number_of_encoded_parts(&data, file);
+
+	buffer = malloc(get_buffer_size_per_encoded_part(&data));
+	longest = 0;
+	for (part = 1; part <= file->number_enc_parts; part++) {
+		length = article_length(&data, file, part, msgid, date,
+					buffer);
+		if (length < 0) {
+			longest = -1;
+			break;
+		}
+		if (length > longest)
+			longest = length;
+	}
+
+	free(buffer);
+	file->map = NULL;
+	file_entry_free(file);
+	buff_free(data.from);
+	buff_free(data.newsgroup);
+	buff_free(data.header);
+
+	return longest;
+}
+
+/* No article may come out longer than -S, even when every byte of the
+ * file has to be escaped, whichever encoding kernel does the work and
+ * whether or not it has the headers TAKETHIS adds. */
+static void check_article_size(const unsigned char *contents)
+{
+	char msgid[NNTP_MSGID_SIZE];
+	char date[NNTP_DATE_SIZE];
+	long size, longest;
+	int i, j, k, stream;
+
+	/* as long as a Message-ID may be */
+	memset(msgid, 'm', NNTP_MSGID_SIZE - 1);
+	msgid[0] = '<';
+	msgid[NNTP_MSGID_SIZE - 3] = '@';
+	msgid[NNTP_MSGID_SIZE - 2] = '>';
+	msgid[NNTP_MSGID_SIZE - 1] = '\0';
+	nntp_make_date(date);
+
+	for (i = 0; i < ELEMENTS(yenc_paths); i++) {
+		if (!yenc_use_kernel(yenc_paths[i]))
+			continue;
+		for (j = 0; j < ELEMENTS(check_lines); j++)
+			for (k = 0; k < ELEMENTS(check_sizes); k++)
+				for (stream = 0; stream <= 1; stream++) {
+					size = check_sizes[k];
+					longest = longest_article(contents,
+						check_lines[j], &size,
+						stream ? msgid : NULL, date);
+					result((longest >= 0) &&
+					       (longest <= size),
+					       "%s, line %i, %s: articles of "
+					       "up to %li bytes for -S %li",
+					       yenc_paths[i], check_lines[j],
+					       stream ? "TAKETHIS" : "POST",
+					       longest, size);
+				}
+	}
+}
+
+/* A TAKETHIS article goes into the spool as it is, so it has to carry
+ * every header RFC 5536 asks for; a POSTed one gets Message-ID, Date
+ * and Path from the server. */
+static void check_takethis_header()
+{
+	static const char *required[] =
+		{ "From", "Newsgroups", "Subject", "Message-ID", "Date",
+		  "Path" };
+	static const char *server_added[] = { "Message-ID", "Date", "Path" };
+	newspost_data data;
+	file_entry *file;
+	char msgid[NNTP_MSGID_SIZE];
+	char date[NNTP_DATE_SIZE];
+	char weekday[4], month[4], zone[6];
+	char *header, *value;
+	int day, year, hour, minute, second, length;
+	boolean ok;
+	int i;
+
+	file = file_entry_alloc();
+	setup(&data, file, NULL, 0);
+	nntp_make_msgid(&data, msgid);
+	nntp_make_date(date);
+
+	header = article_header(&data, msgid, date);
+	for (i = 0; i < ELEMENTS(required); i++)
+		result(header_count(header, required[i]) == 1,
+		       "TAKETHIS article has one %s header", required[i]);
+
+	value = strstr(header, "\r\nPath: ");
+	result((value != NULL) &&
+	       (strncmp(value + 8, "not-for-mail\r\n", 14) == 0),
+	       "TAKETHIS article has Path: not-for-mail");
+
+	/* RFC 5322: "Sun, 17 Oct 2004 12:00:00 +0000" */
+	value = strstr(header, "\r\nDate: ");
+	length = 0;
+	ok = (value != NULL) &&
+		(sscanf(value + 8, "%3[A-Za-z], %2d %3[A-Za-z] %4d "
+			"%2d:%2d:%2d %5[-+0-9]%n", weekday, &day, month,
+			&year, &hour, &minute, &second, zone, &length) == 8) &&
+		(strncmp(value + 8 + length, "\r\n", 2) == 0) &&
+		(strstr("SunMonTueWedThuFriSat", weekday) != NULL) &&
+		(strstr("JanFebMarAprMayJunJulAugSepOctNovDec",
+			month) != NULL) &&
+		(day >= 1) && (day <= 31) && (year >= 2004) &&
+		(hour < 24) && (minute < 60) && (second < 61) &&
+		(strlen(zone) == 5);
+	result(ok, "TAKETHIS article has an RFC 5322 Date: %s", date);
+	free(header);
+
+	header = article_header(&data, NULL, NULL);
+	for (i = 0; i < ELEMENTS(server_added); i++)
+		result(header_count(header, server_added[i]) == 0,
+		       "POSTed article leaves %s to the server",
+		       server_added[i]);
+	free(header);
+
+	file_entry_free(file);
+	buff_free(data.from);
+	buff_free(data.newsgroup);
+	buff_free(data.header);
+}
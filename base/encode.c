@@ -20,18 +20,106 @@
 
 /* Modified and yencoding added by William McBrine <wmcbrine@users.sf.net> */
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
 #include "encode.h"
+#include "nntp.h"
 #include "../enc/uuencode.h"
 #include "../enc/yencode.h"
+#include "../cksfv/sfv.h"
+#include "../ui/ui.h"
+
+/**
+*** Private Declarations
+**/
+
+static const unsigned char *get_part_data(file_entry *file,
+		n_int64 offset, long length, unsigned char **copy);
+static void set_part_crc(file_entry *file, int partnumber,
+			 int total_parts, n_uint32 crc);
+static boolean get_part_crc(file_entry *file, int partnumber,
+			    n_uint32 *crc);
+static boolean get_file_crc(file_entry *file, long message_size,
+			    int total_parts, n_uint32 *crc);
+static long get_article_overhead(newspost_data *data);
+static Buff *get_spool_name(Buff *name, newspost_data *data,
+			    file_entry *file, int partnumber);
 
 /**
 *** Public Routines
 **/
 
+/* returns the number of bytes of the file that go into each part */
+long get_part_size(newspost_data *data) {
+	long size, unit, pagesize;
+
+	/* uuencoded parts are kept to whole lines */
+	unit = (data->uuenc == FALSE) ? 1 : UU_BYTES_PER_LINE;
+
+	if (data->part_size > 0)
+		size = data->part_size;
+	else if (data->uuenc == FALSE)
+		return (long) data->linelength * data->lines;
+	else
+		return UU_BYTES_PER_LINE * data->lines;
+
+	/* start every part on a page boundary of the file */
+	if (data->page_align == TRUE) {
+		pagesize = sysconf(_SC_PAGESIZE);
+		while ((unit % pagesize) != 0)
+			unit += (data->uuenc == FALSE) ? 1 : UU_BYTES_PER_LINE;
+	}
+
+	size -= size % unit;
+	return (size > 0) ? size : unit;
+}
+
+/* works out part_size from article_size; call it once, when all the
+ * options are known */
+void set_part_size(newspost_data *data) {
+	long body, perline;
+
+	if (data->article_size <= 0)
+		return;
+
+	body = data->article_size - get_article_overhead(data);
+
+	if (data->uuenc == FALSE) {
+		/* article_size is a limit, so this is for the worst case,
+		 * where every byte gets escaped: a line then holds half
+		 * as many bytes as it has characters, and each line adds
+		 * a CRLF, the last one included */
+		perline = (data->linelength + 1) / 2;
+		data->part_size = (body - 2) * perline / (2 * perline + 2);
+	}
+	else
+		/* 45 bytes make a line of 63 characters */
+		data->part_size = body / (UU_BYTES_PER_LINE * 4 / 3 + 3) *
+			UU_BYTES_PER_LINE;
+
+	if (data->part_size <= 0)
+		data->part_size = 1;
+}
+
+/* the smallest article size that leaves room for one full line of
+ * the body after the headers */
+long get_min_article_size(newspost_data *data) {
+
+	if (data->uuenc == FALSE)
+		return get_article_overhead(data) + 2 +
+			2 * ((data->linelength + 1) / 2) + 2;
+	else
+		return get_article_overhead(data) +
+			UU_BYTES_PER_LINE * 4 / 3 + 3;
+}
+
 /* returns the total number of parts it will take to encode */
 int get_number_of_encoded_parts(newspost_data *data, file_entry *file) {
 
-	long blocksize = BYTES_PER_LINE * data->lines;
+	long blocksize = get_part_size(data);
 	return ( (file->fileinfo.st_size / blocksize) +
 		((file->fileinfo.st_size % blocksize) != 0) );
 }
@@ -45,14 +133,15 @@ long get_buffer_size_per_encoded_part(newspost_data *data) {
 		 * a few percent bigger than the original.
 		 * Add 512 to cover ybegin, ypart and yend lines. */
 
-		long blocksize = BYTES_PER_LINE * data->lines;
+		long blocksize = get_part_size(data);
 		return ((blocksize * 2) +
-			((blocksize / YENC_LINE_LENGTH) * 4) + 512);
+			((blocksize / data->linelength + 1) * 4) + 512);
 	}
 	else {
 		/* add the 512 just in case of an extremely 
 		 * long file name in the begin line */
-		return ((data->lines * UU_CHARACTERS_PER_LINE) + 512);
+		long lines = get_part_size(data) / UU_BYTES_PER_LINE + 1;
+		return ((lines * UU_CHARACTERS_PER_LINE) + 512);
 	}
 }
 
@@ -60,8 +149,10 @@ long get_buffer_size_per_encoded_part(newspost_data *data) {
 /* fillme should be of size get_buffer_size_per_encoded_part(ed) bytes */
 long get_encoded_part (newspost_data *data, file_entry *file, 
 		  int partnumber, char *fillme) {
-	FILE *fp;
 	long message_size;
+	long pbegin, pend, psize;
+	const unsigned char *source;
+	unsigned char *copy = NULL;
 
 	char *pi = fillme;	/* pointer iterator */
 	int total_parts = get_number_of_encoded_parts(data, file);
@@ -69,35 +160,33 @@ long get_encoded_part (newspost_data *data, file_entry *file,
 	if (!( (partnumber > 0) && (partnumber <= total_parts) ))
 		return -1;
  
-	fp = fopen(file->filename->data, "rb");
-	message_size = BYTES_PER_LINE * data->lines;
+	message_size = get_part_size(data);
+
+	pbegin = message_size * (partnumber - 1) + 1;
+	pend = pbegin + message_size - 1;
+	if (pend > file->fileinfo.st_size)
+		pend = file->fileinfo.st_size;
+	psize = pend - pbegin + 1;
 
-	/* seek to the appropriate place if we're not already there */
-	if (partnumber != 1)
-		fseek(fp, (message_size * (partnumber - 1)), SEEK_SET);
+	source = get_part_data(file, pbegin - 1, psize, &copy);
+	if (source == NULL)
+		return -1;
 
 	/* and encode */
 	if (data->uuenc == FALSE) {
-		long pbegin, pend, psize;
 		n_uint32 crc = 0;
 
-		pbegin = message_size * (partnumber - 1) + 1;
-		pend = pbegin + message_size - 1;
-		if (pend > file->fileinfo.st_size)
-			pend = file->fileinfo.st_size;
-		psize = pend - pbegin + 1;
-
 		/* The first line (or two) */
 
 		if (total_parts == 1)
 			pi += sprintf(pi, "=ybegin line=%i size=%li "
-				"name=%s\r\n", YENC_LINE_LENGTH,
+				"name=%s\r\n", data->linelength,
 				(long) file->fileinfo.st_size,
 				n_basename(file->filename->data));
 		else {
 			pi += sprintf(pi, "=ybegin part=%i total=%i line=%i "
 				"size=%li name=%s\r\n", partnumber,
-				total_parts, YENC_LINE_LENGTH,
+				total_parts, data->linelength,
 				(long) file->fileinfo.st_size,
 				n_basename(file->filename->data));
 
@@ -105,8 +194,10 @@ long get_encoded_part (newspost_data *data, file_entry *file,
 				pbegin, pend);
 		}
 
-		/* The core */
-		pi += yencode(fp, pi, psize, &crc);
+		/* The core; the part crc is worked out while encoding */
+		pi += yencode(source, pi, psize, &crc, data->linelength);
+		if (total_parts > 1)
+			set_part_crc(file, partnumber, total_parts, crc);
 
 		/* The last line */
 		if (total_parts == 1)
@@ -116,9 +207,11 @@ long get_encoded_part (newspost_data *data, file_entry *file,
 			pi += sprintf(pi, "=yend size=%li part=%i pcrc32=%08x",
 				psize, partnumber, crc);
 
-			if (partnumber == total_parts)
-				pi += sprintf(pi, " crc32=%08x\r\n",
-					file->crc);
+			/* leave crc32= out rather than post a wrong one */
+			if ((partnumber == total_parts) &&
+			    (get_file_crc(file, message_size, total_parts,
+					  &crc) == TRUE))
+				pi += sprintf(pi, " crc32=%08x\r\n", crc);
 			else
 				pi += sprintf(pi, "\r\n");
 		}
@@ -129,13 +222,310 @@ long get_encoded_part (newspost_data *data, file_entry *file,
 			pi += sprintf(pi, "begin 644 %s\r\n",
 				n_basename(file->filename->data));
 
-		pi += uu_encode(fp, pi, data->lines);
+		pi += uu_encode(source, pi, psize);
 		
 		/* make sure the appropriate text is put at the end */
 		if (partnumber == total_parts) 
-			pi += sprintf(pi, "end\r\n");
+			pi += sprintf(pi, "`\r\nend\r\n");
 	}
 
-	fclose(fp);
+	free(copy);
 	return pi - fillme;
 }
+
+/* Opens a part encoded and spooled by an earlier run, and sets *length
+ * to its size.  Returns the descriptor, or -1 if there's no such part. */
+int get_spooled_part(newspost_data *data, file_entry *file,
+		     int partnumber, long *length) {
+	Buff *name = NULL;
+	struct stat info;
+	int fd;
+
+	if (file->generated == TRUE)
+		return -1;
+
+	name = get_spool_name(name, data, file, partnumber);
+	fd = open(name->data, O_RDONLY);
+	buff_free(name);
+	if (fd < 0)
+		return -1;
+
+	if ((fstat(fd, &info) == -1) || (info.st_size == 0)) {
+		close(fd);
+		return -1;
+	}
+
+	/* it's in use, so prune_spool() leaves it be */
+	futimens(fd, NULL);
+
+	*length = info.st_size;
+	return fd;
+}
+
+/* Keeps an encoded part in the spool for the next run.  It's written
+ * under a temporary name first, so no run sees half of it.  SFV and PAR
+ * files are made again, with new inodes, every run, so they'd never be
+ * found there. */
+void spool_encoded_part(newspost_data *data, file_entry *file,
+			int partnumber, const char *buffer, long length) {
+	Buff *name = NULL;
+	Buff *tmpname = NULL;
+	long done, nw;
+	int fd;
+
+	if (file->generated == TRUE)
+		return;
+
+	name = get_spool_name(name, data, file, partnumber);
+	tmpname = buff_create(tmpname, "%s.XXXXXX", name->data);
+
+	fd = mkstemp(tmpname->data);
+	if (fd >= 0) {
+		for (done = 0; done < length; done += nw) {
+			nw = write(fd, buffer + done, length - done);
+			if (nw <= 0)
+				break;
+		}
+		close(fd);
+
+		if ((done < length) ||
+		    (rename(tmpname->data, name->data) == -1))
+			unlink(tmpname->data);
+	}
+
+	buff_free(tmpname);
+	buff_free(name);
+}
+
+/* Removes whatever in the spool hasn't been posted for SPOOL_KEEP_DAYS,
+ * and what runs that were killed left half written. */
+void prune_spool(newspost_data *data) {
+	Buff *name = NULL;
+	struct dirent *entry;
+	struct stat info;
+	time_t oldest;
+	DIR *dir;
+
+	dir = opendir(data->spooldir->data);
+	if (dir == NULL)
+		return;
+
+	oldest = time(NULL) - SPOOL_KEEP_DAYS * 24 * 60 * 60;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		name = buff_create(name, "%s/%s", data->spooldir->data,
+				   entry->d_name);
+		if ((lstat(name->data, &info) == 0) &&
+		    S_ISREG(info.st_mode) && (info.st_mtime < oldest))
+			unlink(name->data);
+	}
+
+	closedir(dir);
+	buff_free(name);
+}
+
+/**
+*** Private Routines
+**/
+
+/* Works out how much of an article isn't encoded data: the headers as
+ * nntp_article_iov() lays them out, allowing for the longest subject
+ * line and Message-ID, the yEnc/uuencode framing lines and the
+ * terminating dot. */
+static long get_article_overhead(newspost_data *data) {
+	SList *listptr;
+	long size = 0;
+
+	size += strlen("From: \r\n");
+	if (data->from != NULL)
+		size += data->from->length;
+	if (data->name != NULL)
+		size += data->name->length + 3;	/* name <from> */
+	size += strlen("Newsgroups: \r\n");
+	if (data->newsgroup != NULL)
+		size += data->newsgroup->length;
+	size += strlen("Subject: \r\n") + 512;	/* filename and numbering */
+	if (data->subject != NULL)
+		size += data->subject->length;
+	size += strlen("User-Agent: \r\n" USER_AGENT);
+	if (data->replyto != NULL)
+		size += strlen("Reply-To: \r\n") + data->replyto->length;
+	if (data->followupto != NULL)
+		size += strlen("Followup-To: \r\n") + data->followupto->length;
+	if (data->organization != NULL)
+		size += strlen("Organization: \r\n") +
+			data->organization->length;
+	if (data->reference != NULL)
+		size += strlen("References: \r\n") + data->reference->length;
+	if (data->noarchive == TRUE)
+		size += strlen("X-No-Archive: yes\r\n");
+	for (listptr = data->extra_headers; listptr != NULL;
+	     listptr = slist_next(listptr))
+		size += ((Buff *) listptr->data)->length + 2;
+	if (data->stream > 0)
+		size += strlen("Message-ID: \r\nDate: \r\n"
+			       "Path: not-for-mail\r\n") +
+			NNTP_MSGID_SIZE + NNTP_DATE_SIZE;
+	size += 2;
+
+	/* =ybegin, =ypart, =yend (or begin, `, end) and "\r\n.\r\n" */
+	size += 512 + 5;
+
+	return size;
+}
+
+/* A spooled part is only good for the same file, encoded the same way,
+ * so those go in its name. */
+static Buff *get_spool_name(Buff *name, newspost_data *data,
+			    file_entry *file, int partnumber) {
+	char key[128];
+
+	/* buff_create() doesn't do longs */
+	snprintf(key, sizeof(key), "%lx.%lx.%lx.%lx.%c%i.%li.%i",
+		 (unsigned long) file->fileinfo.st_dev,
+		 (unsigned long) file->fileinfo.st_ino,
+		 (unsigned long) file->fileinfo.st_size,
+		 (unsigned long) file->fileinfo.st_mtime,
+		 (data->uuenc == FALSE) ? 'y' : 'u', data->linelength,
+		 get_part_size(data), partnumber);
+
+	return buff_create(name, "%s/%s.%s", data->spooldir->data,
+			   n_basename(file->filename->data), key);
+}
+
+/* Returns the source bytes of a part.  Normally that's a pointer into
+ * the file's mapping; if the file couldn't be mapped, the part is read
+ * into *copy, which the caller must free(). */
+static const unsigned char *get_part_data(file_entry *file,
+		n_int64 offset, long length, unsigned char **copy) {
+	long pagesize, skew;
+	long nr, done;
+	int fd;
+
+	if (file->map != NULL) {
+		/* start reading this part in while we encode */
+		pagesize = sysconf(_SC_PAGESIZE);
+		skew = offset % pagesize;
+		posix_madvise((void *) (file->map + offset - skew),
+			      length + skew, POSIX_MADV_WILLNEED);
+
+		return file->map + offset;
+	}
+
+	*copy = (unsigned char *) malloc(length);
+	fd = open(file->filename->data, O_RDONLY);
+	if ((*copy == NULL) || (fd < 0)) {
+		ui_generic_error(errno);
+		free(*copy);
+		*copy = NULL;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	for (done = 0; done < length; done += nr) {
+		nr = pread(fd, *copy + done, length - done,
+			   (off_t) (offset + done));
+		if (nr <= 0) {
+			ui_generic_error((nr < 0) ? errno : EIO);
+			free(*copy);
+			*copy = NULL;
+			break;
+		}
+	}
+	close(fd);
+
+	return *copy;
+}
+
+static void set_part_crc(file_entry *file, int partnumber,
+			 int total_parts, n_uint32 crc) {
+
+	pthread_rwlock_wrlock(file->rwlock);
+	if (file->part_crcs == NULL) {
+		file->part_crcs = (n_uint32 *)
+			calloc(total_parts + 1, sizeof(n_uint32));
+		file->part_crc_valid = (boolean *)
+			calloc(total_parts + 1, sizeof(boolean));
+		if ((file->part_crcs == NULL) ||
+		    (file->part_crc_valid == NULL)) {
+			/* it isn't kept then; get_file_crc() works it
+			   out again if it needs it */
+			free(file->part_crcs);
+			free(file->part_crc_valid);
+			file->part_crcs = NULL;
+			file->part_crc_valid = NULL;
+			pthread_rwlock_unlock(file->rwlock);
+			return;
+		}
+	}
+	file->part_crcs[partnumber] = crc;
+	file->part_crc_valid[partnumber] = TRUE;
+	pthread_rwlock_unlock(file->rwlock);
+}
+
+static boolean get_part_crc(file_entry *file, int partnumber,
+			    n_uint32 *crc) {
+	boolean valid = FALSE;
+
+	pthread_rwlock_rdlock(file->rwlock);
+	if ((file->part_crcs != NULL) &&
+	    (file->part_crc_valid[partnumber] == TRUE)) {
+		*crc = file->part_crcs[partnumber];
+		valid = TRUE;
+	}
+	pthread_rwlock_unlock(file->rwlock);
+
+	return valid;
+}
+
+/* The crc of the whole file is put together from the crcs of its
+ * parts, so nothing has to read the file before posting starts.
+ * Parts that have not been encoded yet (other threads still working
+ * on them, or not being posted at all) are checksummed here.  Returns
+ * FALSE if one of those can't be read. */
+static boolean get_file_crc(file_entry *file, long message_size,
+			    int total_parts, n_uint32 *crc) {
+	n_uint32 file_crc, part_crc;
+	long psize;
+	int i;
+
+	pthread_rwlock_rdlock(file->rwlock);
+	if (file->crc_valid == TRUE) {
+		*crc = file->crc;
+		pthread_rwlock_unlock(file->rwlock);
+		return TRUE;
+	}
+	pthread_rwlock_unlock(file->rwlock);
+
+	file_crc = 0;
+	for (i = 1; i <= total_parts; i++) {
+		psize = message_size;
+		if (i == total_parts)
+			psize = file->fileinfo.st_size -
+				(n_int64) message_size * (total_parts - 1);
+
+		if (get_part_crc(file, i, &part_crc) == FALSE) {
+			if (file->map != NULL)
+				part_crc = crc32((const char *) file->map +
+					(n_int64) message_size * (i - 1),
+					psize, 0);
+			else if (calculate_part_crc(file->filename->data,
+					(n_int64) message_size * (i - 1),
+					psize, &part_crc) == FALSE)
+				return FALSE;
+			set_part_crc(file, i, total_parts, part_crc);
+		}
+
+		file_crc = crc32_combine(file_crc, part_crc, psize);
+	}
+
+	pthread_rwlock_wrlock(file->rwlock);
+	file->crc = file_crc;
+	file->crc_valid = TRUE;
+	pthread_rwlock_unlock(file->rwlock);
+
+	*crc = file_crc;
+	return TRUE;
+}
@@ -4,16 +4,35 @@
 
 #include "newspost.h"
 
-#define BYTES_PER_LINE 128
 #define UU_CHARACTERS_PER_LINE 64
 
 /* fills fillme with encoded data, and returns how many characters it wrote */
 long get_encoded_part(newspost_data *data, file_entry *file, 
 		      int partnumber, char *fillme);
 
+/* the same part spooled by an earlier run: its descriptor and length */
+int get_spooled_part(newspost_data *data, file_entry *file,
+		     int partnumber, long *length);
+
+/* keeps an encoded part for the next run */
+void spool_encoded_part(newspost_data *data, file_entry *file,
+			int partnumber, const char *buffer, long length);
+
+/* removes the spooled parts no run has used for a while */
+void prune_spool(newspost_data *data);
+
 /* returns the buffer size that should used for the encoded data */
 long get_buffer_size_per_encoded_part(newspost_data *data);
 
+/* returns the number of bytes of the file that go into each part */
+long get_part_size(newspost_data *data);
+
+/* works out part_size when an article size was asked for */
+void set_part_size(newspost_data *data);
+
+/* the smallest article size that still has room for the body */
+long get_min_article_size(newspost_data *data);
+
 /* returns the total number of parts it will take to encode */
 int get_number_of_encoded_parts(newspost_data *data, file_entry *file);
 
@@ -0,0 +1,2140 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Authors: Pietje Bell <pietjebell@pietjebell.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* The posting engine: a single thread drives the connections to every
+ * server (data->threads to data->address, and as many as each of
+ * data->servers asks for) with non-blocking sockets, through epoll
+ * where there is one and poll() elsewhere.  Every connection is a state
+ * machine (connect, greeting, AUTHINFO, MODE STREAM, then POST or
+ * TAKETHIS) that moves along whenever its socket is ready, and takes
+ * its articles from the ready queue the encoder threads fill.  It's
+ * started before the files are prepared, so the connections are logged
+ * on by the time the first article is; until then they send DATE now
+ * and again so the server keeps them.
+ *
+ * With more than one server, each article goes to the one furthest
+ * behind its share, and the shares follow the rate each server has been
+ * taking articles at.  An article that doesn't make it, because its
+ * connection broke or the server said to try again, goes back in line
+ * with what it was encoded to, for whichever connection is free first;
+ * the broken connection logs on again in the background.  With -b, the
+ * articles go out through a token bucket they all share, in turns of
+ * LIMIT_QUANTUM bytes.  Where io_uring works, the sends are queued on a
+ * ring and go to the kernel together, once per pass of the loop, over
+ * TLS too as long as the kernel does the encryption. */
+
+#include "engine.h"
+#include "socket.h"
+#include "nntp.h"
+#include "uring.h"
+#include "../ui/ui.h"
+#include "../ui/options.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+
+#ifdef __linux__
+#define ENGINE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+
+#define ENGINE_MAX_EVENTS 64
+#define CONNECT_ATTEMPTS 10	/* failed in a row, before a server is given up */
+#define ARTICLE_TRIES 5		/* times an article fails before it's lost */
+#define RATE_PERIOD 1000	/* ms of posting a server's rate is taken over */
+#define RATE_WEIGHT 0.25	/* of the latest period in the rate */
+#define LIMIT_QUANTUM 16384	/* bytes a connection sends per turn under -b */
+
+/* what a connection waits for */
+#define WATCH_IN 1
+#define WATCH_OUT 2
+
+/* everything from CONN_MODE_STREAM on is logged on */
+enum {
+	CONN_WAITING,		/* for its next connect attempt */
+	CONN_CONNECTING,	/* racing connects to the addresses */
+	CONN_TLS,		/* the handshake, with -e */
+	CONN_GREETING,
+	CONN_AUTH_USER,
+	CONN_AUTH_PASS,
+	CONN_MODE_STREAM,
+	CONN_IDLE,		/* logged on, waiting for an article */
+	CONN_POST,		/* waiting for the 340 */
+	CONN_ARTICLE,		/* sending the article, then waiting for 240 */
+	CONN_STREAMING,		/* TAKETHIS whenever the window allows */
+	CONN_KEEPALIVE,		/* waiting for the answer to DATE */
+	CONN_QUIT,
+	CONN_DONE
+};
+
+/* a server's circuit breaker */
+enum {
+	BREAKER_CLOSED,		/* connect whenever */
+	BREAKER_OPEN,		/* wait until retry_at */
+	BREAKER_PROBING		/* one connection tries, the rest wait for it */
+};
+
+/* an article a connection is busy with */
+typedef struct {
+	post_article_t article;
+	char msgid[NNTP_MSGID_SIZE];	/* kept when it's sent again */
+	char date[NNTP_DATE_SIZE];	/* made along with msgid */
+	boolean in_flight;
+	int tries;		/* it went out before and didn't make it */
+	boolean suspect;	/* it was on a connection that broke */
+	unsigned int zc_until;	/* the zc_done its body waits for */
+}
+slot;
+
+typedef struct connection_s connection;
+
+/* a local address connections go out from, and what went out of it */
+typedef struct {
+	const char *address;
+	int weight;
+	socket_address *addrs;	/* looked up once */
+	int naddrs;		/* or FAILED_TO_RESOLVE_HOST */
+	int current;		/* for sharing out the connections */
+	int articles;		/* posted in all */
+	long bytes;
+}
+source;
+
+/* a server, and how fast it has been posting */
+typedef struct {
+	const char *address;
+	int port;
+	Buff *user;
+	Buff *password;
+	connection *conns;	/* its share of engine->conns */
+	int nconns;
+	int next;		/* the connection to try first for an article */
+
+	socket_address *addrs;	/* looked up once */
+	int naddrs;		/* or FAILED_TO_RESOLVE_HOST */
+	int preferred;		/* the address that connected last */
+
+	/* after a failed connect all its connections wait, longer each
+	   time, then one of them tries before the others do */
+	int breaker;
+	int failures;		/* connects that failed in a row */
+	long long retry_at;	/* when BREAKER_OPEN is over */
+	connection *probe;	/* the one trying, with BREAKER_PROBING */
+
+	int in_flight;		/* articles out on all its connections */
+	long long busy_at;	/* when in_flight last changed */
+	long long busy;		/* ms with articles out, this period */
+	long posted;		/* bytes posted this period */
+	double rate;		/* bytes per second, 0 until measured */
+	double finish;		/* where its articles so far put it in line */
+	int articles;		/* posted in all */
+	long bytes;
+}
+server;
+
+struct connection_s {
+	newspost_threadinfo tinfo;	/* the socket, and who we are to the ui */
+	server *srv;
+	source *src;		/* where it connects from, or NULL */
+	boolean bound;		/* it did: the server has an address of
+				   the same family */
+	int index;
+	int state;
+	int attempts;		/* lost connections since it last posted */
+	long long wake_at;	/* when CONN_WAITING is over, or when
+				   CONN_CONNECTING tries another address */
+	long long active_at;	/* when it last sent the server something */
+	long long progress_at;	/* when the socket last got anywhere */
+	int idle_state;		/* what CONN_KEEPALIVE goes back to */
+	int watching;
+	socket_race race;
+
+	/* the write in progress */
+	struct iovec iov[NNTP_ARTICLE_IOV + 3];
+	struct iovec *out;
+	int outcnt;
+	long head;		/* bytes still to go before the body */
+	long body;		/* bytes of the body still to go */
+	struct iovec *file_iov;	/* the body, if it's sent from a spool file */
+	struct iovec *body_iov;	/* or if it's sent from a buffer */
+	int file_fd;
+	long file_length;
+	char command[STRING_BUFSIZE];
+
+	/* sends queued on the ring */
+	struct msghdr msgs[2];	/* the headers and the terminator */
+	int pending;		/* not completed yet */
+	long sent;		/* bytes they've sent so far */
+	int error;		/* the first of them that failed */
+	boolean lost;		/* conn_lost() once they're all in */
+
+	slot *slots;		/* one for POST, data->stream for TAKETHIS */
+	int nslots;
+	int in_flight;
+	int sending;		/* the slot being written, or -1 */
+
+	/* bodies sent with MSG_ZEROCOPY: their buffers go back to the
+	   pool once the kernel is finished with them */
+	boolean zerocopy;
+	unsigned int zc_sent;	/* the sends on this socket so far */
+	unsigned int zc_done;	/* the ones the kernel is finished with */
+	char **held;		/* answered articles' buffers, oldest first */
+	unsigned int *held_until;	/* the zc_done each one waits for */
+	int nheld;
+
+	/* under the bandwidth limit */
+	long allowance;		/* bytes it may send before its next turn */
+	boolean throttled;	/* in line for a turn */
+	connection *next_throttled;
+};
+
+struct engine_s {
+	newspost_data *data;
+	queue *ready;
+	buffer_pool *pool;
+
+	server *servers;	/* data->address first, then data->servers */
+	int nservers;
+	source *sources;	/* data->sources */
+	int nsources;
+	double clock;		/* the finish of the last article handed out */
+
+	connection *conns;
+	int nconns;
+	unsigned int seed;	/* for the jitter in the waits */
+	boolean articles_done;	/* the ready queue is finished and empty,
+				   and every article is answered for */
+	int lost;		/* articles that couldn't be posted */
+	slot *retry;		/* articles to send again, first in first out */
+	int nretry;
+	int retry_first;
+	int retry_size;		/* every slot's article, at most */
+
+	/* the bandwidth limit: a token bucket, with the connections that
+	   want some of it in line */
+	long rate;		/* bytes per second, 0 for none */
+	long burst;		/* bytes it holds at most */
+	double tokens;
+	long long filled_at;
+	connection *throttled;
+	connection *last_throttled;
+
+	int wakeup[2];		/* read and write end; the same eventfd twice */
+	uring *ring;		/* NULL to send with sendmsg() */
+	boolean ring_failed;	/* it turned out not to send after all */
+#ifdef ENGINE_EPOLL
+	int epfd;
+#else
+	/* the wakeup, one per connection, then SOCKET_RACE per connection
+	   for its connects */
+	struct pollfd *pollfds;
+#endif
+	pthread_t thread;
+};
+
+/**
+*** Private Declarations
+**/
+
+static void *engine_loop(void *arg);
+static void dispatch(engine *e);
+static connection *next_connection(engine *e);
+static boolean conn_ready(engine *e, connection *c);
+static boolean take_article(engine *e, slot *s);
+static boolean retry_article(engine *e, slot *s, boolean blamed);
+static void drop_articles(engine *e);
+static void release_article(engine *e, post_article_t *article);
+
+static void server_init(server *srv, const char *address, int port,
+			Buff *user, Buff *password);
+static void server_busy(server *srv, int articles);
+static void server_refused(engine *e, server *srv);
+static void server_posted(server *srv, long length);
+static double server_rate(engine *e, server *srv);
+static source *next_source(engine *e);
+
+static void limit_set(engine *e);
+static long long limit_serve(engine *e);
+static void limit_wait(engine *e, connection *c);
+static void limit_leave(engine *e, connection *c);
+static int limit_iov(struct iovec *limited, const struct iovec *iov,
+		     int count, long length);
+
+static long long conn_timer(engine *e, connection *c);
+static long long conn_deadline(engine *e, connection *c);
+static void conn_wake(engine *e, connection *c);
+static void conn_connect(engine *e, connection *c);
+static void conn_race(engine *e, connection *c);
+static void conn_keepalive(engine *e, connection *c);
+static void conn_connected(engine *e, connection *c);
+static void conn_event(engine *e, connection *c, int events);
+static void conn_handshake(engine *e, connection *c);
+static void conn_read(engine *e, connection *c);
+static boolean conn_response(engine *e, connection *c, const char *line);
+static void conn_logged_on(engine *e, connection *c);
+static boolean conn_command(engine *e, connection *c, const char *format, ...);
+static boolean conn_article(engine *e, connection *c, int s);
+static boolean conn_flush(engine *e, connection *c);
+static boolean conn_submit(engine *e, connection *c);
+static void conn_sent(connection *c, long written);
+static void conn_complete(void *user_data, int res, void *arg);
+static void conn_slot_done(engine *e, connection *c, slot *s, int result,
+			   const char *response);
+static void conn_release(engine *e, connection *c, slot *s);
+static void conn_reap(engine *e, connection *c);
+static void conn_lost(engine *e, connection *c);
+static void conn_failed(engine *e, connection *c);
+static void conn_close(engine *e, connection *c, int state);
+static void conn_status(connection *c, int status);
+
+static boolean poller_init(engine *e);
+static void poller_watch(engine *e, connection *c, int watching);
+static void poller_race(engine *e, connection *c, boolean watching);
+static int poller_wait(engine *e, connection **conns, int *events, int timeout);
+static void poller_free(engine *e);
+
+static long long now_ms();
+
+/**
+*** Public Routines
+**/
+
+/* Sets up the connections and starts the engine's thread; it posts
+ * whatever turns up in ready until queue_finish() is called on it and
+ * it's empty.  Returns NULL if the engine can't run at all. */
+engine *engine_start(newspost_data *data, queue *ready, buffer_pool *pool) {
+	engine *e;
+	server *srv;
+	connection *c;
+	newspost_server *more;
+	newspost_source *from;
+	SList *listptr;
+	char *buffer;
+	int usable = 0;
+	int i, j, k;
+
+	e = (engine *) calloc(1, sizeof(engine));
+	e->data = data;
+	e->ready = ready;
+	e->pool = pool;
+	e->seed = time(NULL) ^ getpid();
+
+	e->nservers = slist_length(data->servers) + 1;
+	e->servers = (server *) calloc(e->nservers, sizeof(server));
+	server_init(&e->servers[0], data->address->data, data->port,
+		    data->user, data->password);
+	e->servers[0].nconns = data->threads;
+	listptr = data->servers;
+	for (i = 1; i < e->nservers; i++) {
+		more = (newspost_server *) listptr->data;
+		server_init(&e->servers[i], more->address->data, more->port,
+			    more->user, more->password);
+		e->servers[i].nconns = more->threads;
+		listptr = slist_next(listptr);
+	}
+	for (i = 0; i < e->nservers; i++)
+		e->nconns += e->servers[i].nconns;
+
+	e->nsources = slist_length(data->sources);
+	e->sources = (source *) calloc(e->nsources + 1, sizeof(source));
+	listptr = data->sources;
+	for (i = 0; i < e->nsources; i++) {
+		from = (newspost_source *) listptr->data;
+		e->sources[i].address = from->address->data;
+		e->sources[i].weight = from->weight;
+		e->sources[i].naddrs = socket_resolve(from->address->data, 0,
+						      &e->sources[i].addrs);
+
+		/* one that isn't local would fail every connect */
+		for (j = 0, k = 0; j < e->sources[i].naddrs; j++)
+			if (socket_bindable(&e->sources[i].addrs[j]))
+				e->sources[i].addrs[k++] =
+					e->sources[i].addrs[j];
+		if (e->sources[i].naddrs >= 0)
+			e->sources[i].naddrs = k;
+
+		if (e->sources[i].naddrs <= 0)
+			ui_socket_bind_failed(from->address->data);
+		else
+			usable++;
+		listptr = slist_next(listptr);
+	}
+	/* connecting from somewhere else isn't what was asked for */
+	if ((e->nsources > 0) && (usable == 0))
+		errno = EADDRNOTAVAIL;
+
+	if (((e->nsources > 0) && (usable == 0)) || !poller_init(e)) {
+		for (i = 0; i < e->nservers; i++)
+			free(e->servers[i].addrs);
+		free(e->servers);
+		for (i = 0; i < e->nsources; i++)
+			free(e->sources[i].addrs);
+		free(e->sources);
+		free(e);
+		return NULL;
+	}
+
+	e->conns = (connection *) calloc(e->nconns, sizeof(connection));
+	srv = e->servers;
+	srv->conns = e->conns;
+	for (i = 0; i < e->nconns; i++) {
+		c = &e->conns[i];
+		if (c == srv->conns + srv->nconns) {
+			srv++;
+			srv->conns = c;
+			/* each server's connections are spread the same */
+			for (j = 0; j < e->nsources; j++)
+				e->sources[j].current = 0;
+		}
+		c->srv = srv;
+		c->src = next_source(e);
+		c->index = i;
+		c->tinfo.thread_id = i + 1;
+		c->tinfo.sockfd = -1;
+		c->tinfo.tls = NULL;
+		c->tinfo.status = THREAD_INITIALIZING;
+		c->tinfo.bytes_written = 0;
+		c->tinfo.rwlock =
+			(pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t));
+		pthread_rwlock_init(c->tinfo.rwlock, NULL);
+		c->state = CONN_WAITING;
+		c->wake_at = 0;
+		c->sending = -1;
+		c->nslots = (data->stream > 1) ? data->stream : 1;
+		c->slots = (slot *) calloc(c->nslots, sizeof(slot));
+		if (data->zerocopy) {
+			/* no more than there are buffers */
+			c->held = (char **) malloc(pool->count *
+						   sizeof(char *));
+			c->held_until = (unsigned int *)
+				malloc(pool->count * sizeof(unsigned int));
+		}
+		for (j = 0; j < c->nslots; j++) {
+			c->slots[j].article.partnumber = -1;
+			c->slots[j].article.spool_fd = -1;
+		}
+		e->retry_size += c->nslots;
+	}
+	e->retry = (slot *) calloc(e->retry_size, sizeof(slot));
+
+#ifdef ENGINE_EPOLL
+	/* each connection has one article or command out at a time, in
+	   three sends at most */
+	for (i = 8; i < e->nconns * 3; i *= 2)
+		;
+	e->ring = uring_init(i, e->wakeup[0]);
+	if (e->ring != NULL) {
+		buffer = buffer_pool_preallocate(pool);
+		if (buffer != NULL)
+			uring_register(e->ring, buffer, pool->count * pool->size);
+	}
+#endif
+
+	limit_set(e);
+	ready->event_fd = e->wakeup[1];
+
+	pthread_create(&e->thread, NULL, engine_loop, e);
+
+	return e;
+}
+
+/* Waits for the engine to post everything and log off.  Returns
+ * POSTING_FAILED if any article couldn't be posted, else NORMAL. */
+int engine_finish(engine *e) {
+	connection *c;
+	int retval;
+	int i, j;
+
+	pthread_join(e->thread, NULL);
+
+	pthread_mutex_lock(e->ready->mut);
+	e->ready->event_fd = -1;
+	pthread_mutex_unlock(e->ready->mut);
+
+	for (i = 0; i < e->nconns; i++) {
+		c = &e->conns[i];
+		for (j = 0; j < c->nslots; j++)
+			buff_free(c->slots[j].article.subject);
+		free(c->slots);
+		free(c->held);
+		free(c->held_until);
+		pthread_rwlock_destroy(c->tinfo.rwlock);
+		free(c->tinfo.rwlock);
+	}
+	free(e->conns);
+	for (i = 0; i < e->retry_size; i++)
+		buff_free(e->retry[i].article.subject);
+	free(e->retry);
+	for (i = 0; i < e->nservers; i++) {
+		if (e->nservers > 1)
+			ui_server_posted(e->servers[i].address,
+					 e->servers[i].port,
+					 e->servers[i].articles,
+					 e->servers[i].bytes);
+		free(e->servers[i].addrs);
+	}
+	free(e->servers);
+	for (i = 0; i < e->nsources; i++) {
+		if (e->sources[i].naddrs > 0)
+			ui_source_posted(e->sources[i].address,
+					 e->sources[i].articles,
+					 e->sources[i].bytes);
+		free(e->sources[i].addrs);
+	}
+	free(e->sources);
+	if (e->ring != NULL)
+		uring_free(e->ring);
+	poller_free(e);
+	retval = (e->lost > 0) ? POSTING_FAILED : NORMAL;
+	free(e);
+
+	return retval;
+}
+
+/**
+*** Private Routines
+**/
+
+static void *engine_loop(void *arg) {
+	engine *e = (engine *) arg;
+	connection *c;
+	connection *ready_conns[ENGINE_MAX_EVENTS];
+	int events[ENGINE_MAX_EVENTS];
+	unsigned long long count;
+	long long now, wake_at;
+	int timeout;
+	int i, n, done;
+
+	while (TRUE) {
+		if (e->data->bandwidth_changed) {
+			e->data->bandwidth_changed = FALSE;
+			reread_bandwidth(e->data);
+			limit_set(e);
+			ui_bandwidth_changed(e->data->bandwidth, e->burst);
+		}
+
+		/* connections whose wait is over, connects that could
+		   use another address, idle ones due for a DATE, and
+		   ones that got stuck */
+		now = now_ms();
+		timeout = -1;
+		for (i = 0; i < e->nconns; i++) {
+			c = &e->conns[i];
+			wake_at = conn_timer(e, c);
+			if ((wake_at >= 0) && (wake_at <= now)) {
+				conn_wake(e, c);
+				wake_at = conn_timer(e, c);
+			}
+			if ((wake_at >= 0) &&
+			    ((timeout < 0) || (wake_at - now < timeout)))
+				timeout = (wake_at > now) ? wake_at - now : 0;
+		}
+
+		dispatch(e);
+
+		/* turns for connections held up by the bandwidth limit */
+		wake_at = limit_serve(e);
+		if (wake_at >= 0) {
+			now = now_ms();
+			if ((timeout < 0) || (wake_at - now < timeout))
+				timeout = (wake_at > now) ? wake_at - now : 0;
+		}
+
+		done = 0;
+		for (i = 0; i < e->nconns; i++)
+			if ((e->conns[i].state == CONN_DONE) &&
+			    (e->conns[i].pending == 0))
+				done++;
+		if (done == e->nconns) {
+			if (e->articles_done)
+				break;
+			/* nobody is left to post them */
+			drop_articles(e);
+		}
+
+		if (e->ring != NULL)
+			uring_submit(e->ring);
+
+		n = poller_wait(e, ready_conns, events, timeout);
+		if (e->ring != NULL)
+			uring_reap(e->ring, conn_complete, e);
+		for (i = 0; i < n; i++) {
+			if (ready_conns[i] == NULL) {
+				/* the wakeup: just empty it */
+				while (read(e->wakeup[0], &count,
+					    sizeof(count)) > 0)
+					;
+				continue;
+			}
+			/* an earlier event may have closed it */
+			if (((ready_conns[i]->tinfo.sockfd >= 0) ||
+			     (ready_conns[i]->state == CONN_CONNECTING)) &&
+			    !ready_conns[i]->lost)
+				conn_event(e, ready_conns[i], events[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/* Hands out articles while there are connections to take them, then
+ * sends connections that have nothing left to do home. */
+static void dispatch(engine *e) {
+	connection *c;
+	server *srv;
+	int i, s;
+
+	while (!e->articles_done) {
+		c = next_connection(e);
+		if (c == NULL)
+			break;
+		srv = c->srv;
+
+		s = 0;
+		if (c->state == CONN_STREAMING)
+			while (c->slots[s].in_flight)
+				s++;
+		if (!take_article(e, &c->slots[s]))
+			break;
+		c->slots[s].in_flight = TRUE;
+		c->in_flight++;
+		server_busy(srv, 1);
+
+		/* it goes to the back of the line for as long as the
+		   article takes it at its rate */
+		if (srv->finish < e->clock)
+			srv->finish = e->clock;
+		e->clock = srv->finish;
+		srv->finish += c->slots[s].article.length /
+			server_rate(e, srv);
+
+		if (c->state == CONN_IDLE) {
+			c->state = CONN_POST;
+			conn_command(e, c, "POST");
+		}
+		else {
+			if (c->slots[s].msgid[0] == '\0') {
+				nntp_make_msgid(e->data, c->slots[s].msgid);
+				nntp_make_date(c->slots[s].date);
+			}
+			conn_article(e, c, s);
+		}
+	}
+
+	/* the connections stay until nothing can come back for them */
+	if (!e->articles_done) {
+		if (e->nretry > 0)
+			return;
+		for (i = 0; i < e->nservers; i++)
+			if (e->servers[i].in_flight > 0)
+				return;
+		pthread_mutex_lock(e->ready->mut);
+		e->articles_done = e->ready->empty && e->ready->producer_done;
+		pthread_mutex_unlock(e->ready->mut);
+		if (!e->articles_done)
+			return;
+	}
+
+	for (i = 0; i < e->nconns; i++) {
+		c = &e->conns[i];
+
+		switch (c->state) {
+		case CONN_IDLE:
+			c->state = CONN_QUIT;
+			conn_command(e, c, "QUIT");
+			break;
+		case CONN_STREAMING:
+			if (c->in_flight > 0)
+				break;
+			c->state = CONN_QUIT;
+			conn_command(e, c, "QUIT");
+			break;
+		case CONN_WAITING:
+		case CONN_CONNECTING:
+		case CONN_TLS:
+			/* no need for it anymore */
+			conn_close(e, c, CONN_DONE);
+			break;
+		}
+	}
+}
+
+/* Picks the connection for the next article: one of the server that
+ * has had the least of its share so far, taking turns among its
+ * connections.  Returns NULL if none can take an article now. */
+static connection *next_connection(engine *e) {
+	server *srv, *best = NULL;
+	connection *c = NULL;
+	double start, best_start = 0;
+	int i, j;
+
+	for (i = 0; i < e->nservers; i++) {
+		srv = &e->servers[i];
+		/* it's had no more than its share while it couldn't
+		   take any */
+		start = (srv->finish > e->clock) ? srv->finish : e->clock;
+		if ((best != NULL) && (start >= best_start))
+			continue;
+		for (j = 0; j < srv->nconns; j++)
+			if (conn_ready(e, &srv->conns[(srv->next + j) %
+						   srv->nconns]))
+				break;
+		if (j == srv->nconns)
+			continue;
+		best = srv;
+		best_start = start;
+		c = &srv->conns[(srv->next + j) % srv->nconns];
+	}
+
+	if (best != NULL)
+		best->next = (c - best->conns + 1) % best->nconns;
+	return c;
+}
+
+/* If the connection can take another article right now.  An article
+ * that was on a broken connection goes out on its own, so that if it
+ * breaks this one too, there's no doubt it was that article. */
+static boolean conn_ready(engine *e, connection *c) {
+	int s;
+
+	if (c->state == CONN_IDLE)
+		return TRUE;
+	if ((c->state != CONN_STREAMING) || (c->sending >= 0) ||
+	    (c->in_flight == c->nslots))
+		return FALSE;
+
+	if ((e->nretry > 0) && e->retry[e->retry_first].suspect)
+		return (c->in_flight == 0);
+	for (s = 0; s < c->nslots; s++)
+		if (c->slots[s].in_flight && c->slots[s].suspect)
+			return FALSE;
+	return TRUE;
+}
+
+/* Takes the next article to send again into s, or else the next one
+ * out of the ready queue, if there is one.  Any the encoders couldn't
+ * encode are counted as lost on the way. */
+static boolean take_article(engine *e, slot *s) {
+	queue *ready = e->ready;
+	slot *r;
+
+	if (e->nretry > 0) {
+		r = &e->retry[e->retry_first];
+		s->article.file_data = r->article.file_data;
+		s->article.partnumber = r->article.partnumber;
+		s->article.subject = buff_create(s->article.subject, "%s",
+						 r->article.subject->data);
+		s->article.buffer = r->article.buffer;
+		s->article.spool_fd = r->article.spool_fd;
+		s->article.length = r->article.length;
+		memcpy(s->msgid, r->msgid, NNTP_MSGID_SIZE);
+		memcpy(s->date, r->date, NNTP_DATE_SIZE);
+		s->tries = r->tries;
+		s->suspect = r->suspect;
+		e->retry_first = (e->retry_first + 1) % e->retry_size;
+		e->nretry--;
+		return TRUE;
+	}
+
+	while (TRUE) {
+		pthread_mutex_lock(ready->mut);
+		if (ready->empty) {
+			pthread_mutex_unlock(ready->mut);
+			return FALSE;
+		}
+		queue_item_del(ready, &s->article);
+		pthread_mutex_unlock(ready->mut);
+
+		pthread_cond_signal(ready->cond_not_full);
+
+		/* the encoders pass on the ones they couldn't encode */
+		if (s->article.length >= 0)
+			break;
+		ui_posting_part_lost(s->article.file_data,
+				     s->article.partnumber);
+		e->lost++;
+	}
+
+	s->msgid[0] = '\0';
+	s->tries = 0;
+	s->suspect = FALSE;
+	if (s->article.partnumber == 1)
+		ui_posting_file_start(e->data, s->article.file_data,
+				      s->article.length);
+
+	return TRUE;
+}
+
+/* Puts the article in s back for any connection to take, buffer and
+ * all.  There's always room: only the slots' articles come back, and
+ * the slots don't take new ones while any are waiting.  Returns FALSE
+ * if it has failed too often already; it only counts as failing when
+ * it's to blame, not when it merely went down with a connection. */
+static boolean retry_article(engine *e, slot *s, boolean blamed) {
+	slot *r;
+
+	if (blamed && (++s->tries >= ARTICLE_TRIES))
+		return FALSE;
+
+	r = &e->retry[(e->retry_first + e->nretry) % e->retry_size];
+	r->article.file_data = s->article.file_data;
+	r->article.partnumber = s->article.partnumber;
+	r->article.subject = buff_create(r->article.subject, "%s",
+					 s->article.subject->data);
+	r->article.buffer = s->article.buffer;
+	r->article.spool_fd = s->article.spool_fd;
+	r->article.length = s->article.length;
+	memcpy(r->msgid, s->msgid, NNTP_MSGID_SIZE);
+	memcpy(r->date, s->date, NNTP_DATE_SIZE);
+	r->tries = s->tries;
+	r->suspect = s->suspect;
+	e->nretry++;
+
+	s->article.buffer = NULL;
+	s->article.spool_fd = -1;
+	return TRUE;
+}
+
+/* every connection gave up; the encoders mustn't wait for them */
+static void drop_articles(engine *e) {
+	slot s;
+
+	s.article.subject = NULL;
+	while (take_article(e, &s)) {
+		ui_posting_part_lost(s.article.file_data, s.article.partnumber);
+		release_article(e, &s.article);
+		e->lost++;
+	}
+	buff_free(s.article.subject);
+}
+
+/* gives back the buffer or spool file an article was sent from */
+static void release_article(engine *e, post_article_t *article) {
+	if (article->buffer != NULL)
+		buffer_pool_put(e->pool, article->buffer);
+	if (article->spool_fd >= 0)
+		close(article->spool_fd);
+	article->buffer = NULL;
+	article->spool_fd = -1;
+}
+
+static void server_init(server *srv, const char *address, int port,
+			Buff *user, Buff *password) {
+	srv->address = address;
+	srv->port = port;
+	srv->user = user;
+	srv->password = password;
+	srv->naddrs = socket_resolve(address, port, &srv->addrs);
+	srv->busy_at = now_ms();
+}
+
+/* counts the time srv has articles out, which its rate is taken over */
+static void server_busy(server *srv, int articles) {
+	long long now = now_ms();
+
+	if (srv->in_flight > 0)
+		srv->busy += now - srv->busy_at;
+	srv->busy_at = now;
+	srv->in_flight += articles;
+}
+
+/* srv won't ever let a connection on, e.g. its certificate doesn't
+ * check out: those not logged on yet stop trying, and none of them
+ * complains about it again */
+static void server_refused(engine *e, server *srv) {
+	int i;
+
+	srv->failures = CONNECT_ATTEMPTS;
+	for (i = 0; i < srv->nconns; i++)
+		if (srv->conns[i].state < CONN_GREETING)
+			conn_close(e, &srv->conns[i], CONN_DONE);
+}
+
+/* srv posted an article; every RATE_PERIOD its rate catches up */
+static void server_posted(server *srv, long length) {
+	double rate;
+
+	srv->articles++;
+	srv->bytes += length;
+	srv->posted += length;
+	if (srv->busy < RATE_PERIOD)
+		return;
+
+	rate = srv->posted * 1000.0 / srv->busy;
+	if (srv->rate > 0)
+		srv->rate += (rate - srv->rate) * RATE_WEIGHT;
+	else
+		srv->rate = rate;
+	srv->posted = 0;
+	srv->busy = 0;
+}
+
+/* Picks the local address for the next connection: they take turns,
+ * as many as its weight each (smooth weighted round-robin, as in
+ * nginx).  Returns NULL if there are none to pick from. */
+static source *next_source(engine *e) {
+	source *best = NULL;
+	int total = 0;
+	int i;
+
+	for (i = 0; i < e->nsources; i++) {
+		if (e->sources[i].naddrs <= 0)
+			continue;
+		e->sources[i].current += e->sources[i].weight;
+		total += e->sources[i].weight;
+		if ((best == NULL) || (e->sources[i].current > best->current))
+			best = &e->sources[i];
+	}
+	if (best != NULL)
+		best->current -= total;
+	return best;
+}
+
+/* what srv's share goes by: its rate, or until it has one, the best
+ * there is, so it gets tried */
+static double server_rate(engine *e, server *srv) {
+	double best = 0;
+	int i;
+
+	if (srv->rate > 0)
+		return srv->rate;
+	for (i = 0; i < e->nservers; i++)
+		if (e->servers[i].rate > best)
+			best = e->servers[i].rate;
+	return (best > 0) ? best : 1;
+}
+
+/* when the connection has something to do next without its socket,
+ * or -1 */
+static long long conn_timer(engine *e, connection *c) {
+	long long wake_at = -1, deadline;
+
+	switch (c->state) {
+	case CONN_WAITING:
+		/* the server's breaker has a say in it */
+		if (c->srv->breaker == BREAKER_OPEN)
+			wake_at = c->srv->retry_at;
+		else if (c->srv->breaker != BREAKER_PROBING)
+			wake_at = c->wake_at;
+		break;
+	case CONN_CONNECTING:
+		if (c->race.next < c->race.naddrs)
+			wake_at = c->wake_at;
+		break;
+	case CONN_STREAMING:
+		if ((c->in_flight > 0) || (c->sending >= 0))
+			break;
+		/* fall through */
+	case CONN_IDLE:
+		wake_at = c->active_at + NNTP_KEEPALIVE_SECONDS * 1000LL;
+	}
+
+	deadline = conn_deadline(e, c);
+	if ((deadline >= 0) && ((wake_at < 0) || (deadline < wake_at)))
+		wake_at = deadline;
+	return wake_at;
+}
+
+/* When the connection will have waited too long on the server, or -1.
+ * Waiting its turn under the bandwidth limit doesn't count. */
+static long long conn_deadline(engine *e, connection *c) {
+	int seconds;
+
+	if (c->throttled || c->lost)
+		return -1;
+
+	switch (c->state) {
+	case CONN_WAITING:
+	case CONN_DONE:
+		return -1;
+	case CONN_CONNECTING:
+	case CONN_TLS:
+		seconds = e->data->connect_timeout;
+		break;
+	case CONN_STREAMING:
+		if ((c->in_flight == 0) && (c->outcnt == 0))
+			return -1;
+		/* fall through */
+	default:
+		if ((c->outcnt > 0) || (c->pending > 0))
+			seconds = e->data->send_timeout;
+		else if (c->state == CONN_IDLE)
+			return -1;
+		else
+			seconds = e->data->response_timeout;
+	}
+	if (seconds == 0)
+		return -1;
+	return c->progress_at + seconds * 1000LL;
+}
+
+/* does what conn_timer() said it would */
+static void conn_wake(engine *e, connection *c) {
+	long long deadline;
+
+	/* a connection that got stuck is dropped, and its articles
+	   go to the others */
+	deadline = conn_deadline(e, c);
+	if ((deadline >= 0) && (deadline <= now_ms())) {
+		ui_socket_stalled(&c->tinfo, (int)
+				  ((now_ms() - c->progress_at) / 1000));
+		conn_lost(e, c);
+		return;
+	}
+
+	switch (c->state) {
+	case CONN_WAITING:
+		if (c->srv->breaker == BREAKER_OPEN) {
+			/* it goes first, and the others see how it does */
+			c->srv->breaker = BREAKER_PROBING;
+			c->srv->probe = c;
+		}
+		conn_connect(e, c);
+		break;
+	case CONN_CONNECTING:
+		conn_race(e, c);
+		break;
+	default:
+		conn_keepalive(e, c);
+	}
+}
+
+static void conn_connect(engine *e, connection *c) {
+	server *srv = c->srv;
+
+	conn_status(c, THREAD_CONNECTING);
+	ui_socket_connect_start(&c->tinfo, srv->address);
+	c->progress_at = now_ms();
+
+	if (srv->naddrs < 0)
+		srv->naddrs = socket_resolve(srv->address, srv->port,
+					     &srv->addrs);
+	if (srv->naddrs < 0) {
+		ui_socket_connect_failed(&c->tinfo, srv->naddrs);
+		conn_failed(e, c);
+		return;
+	}
+
+	if (c->src != NULL)
+		socket_race_start(&c->race, srv->addrs, srv->naddrs,
+				  srv->preferred, c->src->addrs,
+				  c->src->naddrs);
+	else
+		socket_race_start(&c->race, srv->addrs, srv->naddrs,
+				  srv->preferred, NULL, 0);
+	if (!socket_race_next(&c->race)) {
+		ui_socket_connect_failed(&c->tinfo, FAILED_TO_CREATE_SOCKET);
+		conn_failed(e, c);
+		return;
+	}
+
+	c->state = CONN_CONNECTING;
+	c->wake_at = now_ms() + SOCKET_RACE_DELAY;
+	poller_race(e, c, TRUE);
+}
+
+/* nobody answered in time: the next address joins the race */
+static void conn_race(engine *e, connection *c) {
+	poller_race(e, c, FALSE);
+	socket_race_next(&c->race);
+	poller_race(e, c, TRUE);
+	c->wake_at = now_ms() + SOCKET_RACE_DELAY;
+}
+
+/* one of the connects got through; the others are dropped */
+static void conn_connected(engine *e, connection *c) {
+	int i;
+
+	c->srv->preferred = c->race.won;
+	c->bound = FALSE;
+	for (i = 0; (c->src != NULL) && (i < c->src->naddrs); i++)
+		if (c->src->addrs[i].addr.ss_family ==
+		    c->srv->addrs[c->race.won].addr.ss_family)
+			c->bound = TRUE;
+	socket_race_end(&c->race);
+	socket_buffer_init(&c->tinfo.input);
+	c->active_at = now_ms();
+	c->progress_at = c->active_at;
+}
+
+/* there's nothing to post yet; a cheap command keeps the server from
+ * hanging up on an idle connection */
+static void conn_keepalive(engine *e, connection *c) {
+	c->idle_state = c->state;
+	c->state = CONN_KEEPALIVE;
+	conn_command(e, c, "DATE");
+}
+
+static void conn_event(engine *e, connection *c, int events) {
+	int result;
+
+	if (c->state == CONN_CONNECTING) {
+		poller_race(e, c, FALSE);
+		result = socket_race_check(&c->race, &c->tinfo.sockfd);
+		if (result == SOCKET_WANT_WRITE) {
+			poller_race(e, c, TRUE);
+			return;
+		}
+		if (result != NORMAL) {
+			conn_close(e, c, CONN_WAITING);
+			ui_socket_connect_failed(&c->tinfo,
+						 FAILED_TO_CREATE_SOCKET);
+			conn_failed(e, c);
+			return;
+		}
+		conn_connected(e, c);
+		if (e->data->tls == TRUE) {
+			if (socket_tls_start(&c->tinfo,
+					     c->srv->address) != NORMAL) {
+				conn_close(e, c, CONN_WAITING);
+				ui_socket_connect_failed(&c->tinfo, TLS_FAILED);
+				conn_failed(e, c);
+				return;
+			}
+			c->state = CONN_TLS;
+		}
+		else {
+			ui_socket_connect_done(&c->tinfo);
+			ui_nntp_logon_start(&c->tinfo, c->srv->address);
+			c->state = CONN_GREETING;
+			poller_watch(e, c, WATCH_IN);
+			return;
+		}
+	}
+
+	if (c->state == CONN_TLS) {
+		conn_handshake(e, c);
+		return;
+	}
+
+	/* the kernel tells about zero-copy sends as errors */
+	conn_reap(e, c);
+
+	if ((events & WATCH_OUT) && (c->outcnt > 0))
+		if (!conn_flush(e, c))
+			return;
+
+	if (events & WATCH_IN)
+		conn_read(e, c);
+}
+
+/* takes the TLS handshake as far as the socket lets it */
+static void conn_handshake(engine *e, connection *c) {
+	switch (socket_tls_handshake(&c->tinfo)) {
+	case NORMAL:
+		break;
+	case SOCKET_WANT_READ:
+		poller_watch(e, c, WATCH_IN);
+		return;
+	case SOCKET_WANT_WRITE:
+		poller_watch(e, c, WATCH_OUT);
+		return;
+	case TLS_REFUSED:
+		ui_tls_refused(&c->tinfo, c->srv->address);
+		server_refused(e, c->srv);
+		return;
+	default:
+		conn_close(e, c, CONN_WAITING);
+		ui_socket_connect_failed(&c->tinfo, TLS_FAILED);
+		conn_failed(e, c);
+		return;
+	}
+
+	ui_socket_connect_done(&c->tinfo);
+	ui_tls_started(&c->tinfo, socket_kernel_sends(&c->tinfo));
+	ui_nntp_logon_start(&c->tinfo, c->srv->address);
+	c->state = CONN_GREETING;
+	c->progress_at = now_ms();
+	poller_watch(e, c, WATCH_IN);
+}
+
+/* reads what the server sent and acts on every whole line of it */
+static void conn_read(engine *e, connection *c) {
+	char line[STRING_BUFSIZE];
+	long retval;
+
+	/* the server can't answer a send before it's done */
+	if ((e->ring != NULL) && (c->pending > 0)) {
+		uring_reap(e->ring, conn_complete, e);
+		if ((c->tinfo.sockfd < 0) || c->lost)
+			return;
+	}
+
+	/* TLS may have more decrypted than there was room for */
+	do {
+		retval = socket_fill(&c->tinfo);
+		if (retval < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+			    (errno == EINTR))
+				return;
+			ui_socket_error(errno);
+		}
+		if (retval <= 0) {
+			conn_lost(e, c);
+			return;
+		}
+		c->progress_at = now_ms();
+
+		while (socket_takeline(&c->tinfo.input, line,
+				       STRING_BUFSIZE) > 0) {
+			ui_nntp_server_response(&c->tinfo, line);
+			if (!conn_response(e, c, line))
+				return;
+		}
+	} while (socket_pending(&c->tinfo));
+}
+
+/* Moves the connection along on a line from the server.  Returns
+ * FALSE if the connection is gone after it. */
+static boolean conn_response(engine *e, connection *c, const char *line) {
+	server *srv = c->srv;
+	char msgid[NNTP_MSGID_SIZE];
+	int result;
+	int s;
+
+	switch (c->state) {
+
+	case CONN_GREETING:
+		if ((strncmp(line, NNTP_GREETING_POSTING_OK, 3) != 0) &&
+		    (strncmp(line, NNTP_GREETING_NO_POSTING, 3) != 0)) {
+			ui_nntp_unknown_response(&c->tinfo, line);
+			conn_lost(e, c);
+			return FALSE;
+		}
+		if (srv->user == NULL) {
+			conn_logged_on(e, c);
+			break;
+		}
+		c->state = CONN_AUTH_USER;
+		return conn_command(e, c, "AUTHINFO USER %s",
+				    srv->user->data);
+
+	case CONN_AUTH_USER:
+		/* 381: More Authentication required */
+		if (strncmp(line, NNTP_MORE_AUTHENTICATION_REQUIRED, 3) == 0) {
+			c->state = CONN_AUTH_PASS;
+			return conn_command(e, c, "AUTHINFO PASS %s",
+					    srv->password->data);
+		}
+		/* 281: Authentication successful,
+		   500: server doesn't support authinfo */
+		if ((strncmp(line, NNTP_AUTHENTICATION_SUCCESSFUL, 3) != 0) &&
+		    (strncmp(line, NNTP_UNKNOWN_COMMAND, 3) != 0))
+			ui_nntp_unknown_response(&c->tinfo, line);
+		conn_logged_on(e, c);
+		break;
+
+	case CONN_AUTH_PASS:
+		if (strncmp(line, NTTP_AUTHENTICATION_UNSUCCESSFUL, 3) == 0) {
+			ui_nntp_authentication_failed(&c->tinfo, line);
+			conn_close(e, c, CONN_DONE);
+			return FALSE;
+		}
+		conn_logged_on(e, c);
+		break;
+
+	case CONN_MODE_STREAM:
+		if (strncmp(line, NNTP_STREAMING_OK, 3) == 0)
+			c->state = CONN_STREAMING;
+		else
+			c->state = CONN_IDLE;
+		break;
+
+	case CONN_POST:
+		if (strncmp(line, NNTP_PROCEED_WITH_POST, 3) == 0) {
+			c->state = CONN_ARTICLE;
+			return conn_article(e, c, 0);
+		}
+		if (strncmp(line, NNTP_POSTING_NOT_ALLOWED, 3) == 0) {
+			conn_slot_done(e, c, &c->slots[0], POSTING_NOT_ALLOWED,
+				       line);
+			c->state = CONN_QUIT;
+			return conn_command(e, c, "QUIT");
+		}
+		/* this shouldn't really happen */
+		ui_nntp_unknown_response(&c->tinfo, line);
+		conn_slot_done(e, c, &c->slots[0], POSTING_FAILED, line);
+		c->state = CONN_IDLE;
+		break;
+
+	case CONN_ARTICLE:
+		if (c->sending >= 0) {
+			/* it's not supposed to answer before the end */
+			ui_nntp_unknown_response(&c->tinfo, line);
+			conn_lost(e, c);
+			return FALSE;
+		}
+		if (strncmp(line, NNTP_ARTICLE_POSTED_OK, 3) == 0)
+			result = NORMAL;
+		else {
+			if (strncmp(line, NNTP_POSTING_FAILED, 3) != 0)
+				/* shouldn't really happen */
+				ui_nntp_unknown_response(&c->tinfo, line);
+			result = POSTING_FAILED;
+		}
+		conn_slot_done(e, c, &c->slots[0], result, line);
+		c->state = CONN_IDLE;
+		break;
+
+	case CONN_STREAMING:
+		/* answers may come in any order */
+		result = nntp_takethis_answer(line, msgid);
+		for (s = 0; s < c->nslots; s++)
+			if (c->slots[s].in_flight &&
+			    (strcmp(c->slots[s].msgid, msgid) == 0))
+				break;
+		if ((result == POSTING_FAILED) || (s == c->nslots) ||
+		    (s == c->sending)) {
+			ui_nntp_unknown_response(&c->tinfo, line);
+			conn_lost(e, c);
+			return FALSE;
+		}
+		conn_slot_done(e, c, &c->slots[s], result, line);
+		break;
+
+	case CONN_KEEPALIVE:
+		/* 111, or 500 from a server without DATE; either will do */
+		c->state = c->idle_state;
+		break;
+
+	case CONN_QUIT:
+		conn_close(e, c, CONN_DONE);
+		return FALSE;
+
+	default:
+		/* e.g. a server that times out an idle connection */
+		ui_nntp_unknown_response(&c->tinfo, line);
+	}
+
+	return TRUE;
+}
+
+static void conn_logged_on(engine *e, connection *c) {
+	ui_nntp_logon_done(&c->tinfo);
+	conn_status(c, THREAD_POSTING);
+
+	/* the server is back: its other connections can go ahead */
+	c->srv->breaker = BREAKER_CLOSED;
+	c->srv->probe = NULL;
+	c->srv->failures = 0;
+
+	/* not over TLS, which has to copy to encrypt anyway */
+	if (e->data->zerocopy)
+		c->zerocopy = socket_zerocopy(&c->tinfo);
+
+	if (e->data->stream > 0) {
+		c->state = CONN_MODE_STREAM;
+		conn_command(e, c, "MODE STREAM");
+	}
+	else
+		c->state = CONN_IDLE;
+}
+
+/* Sends a command.  Returns FALSE if the connection is gone after it. */
+static boolean conn_command(engine *e, connection *c, const char *format, ...) {
+	va_list ap;
+	int length;
+
+	va_start(ap, format);
+	length = vsnprintf(c->command, STRING_BUFSIZE - 2, format, ap);
+	va_end(ap);
+	if (length > STRING_BUFSIZE - 3)
+		length = STRING_BUFSIZE - 3;
+
+	ui_nntp_command_issued(&c->tinfo, c->command);
+
+	c->command[length++] = '\r';
+	c->command[length++] = '\n';
+	c->iov[0].iov_base = c->command;
+	c->iov[0].iov_len = length;
+	c->out = c->iov;
+	c->outcnt = 1;
+	c->head = length;
+	c->body = 0;
+	c->file_iov = NULL;
+	c->body_iov = NULL;
+	c->active_at = now_ms();
+	c->progress_at = c->active_at;
+
+	return conn_flush(e, c);
+}
+
+/* Sends the article in slot s: after a 340 for POST, or with TAKETHIS
+ * in front when streaming.  Returns FALSE if the connection is gone
+ * after it. */
+static boolean conn_article(engine *e, connection *c, int s) {
+	post_article_t *article = &c->slots[s].article;
+	int iovcnt = 0;
+	int i;
+
+	ui_posting_part_start(&c->tinfo, article->file_data,
+			      article->partnumber);
+
+	if (c->state == CONN_STREAMING) {
+		c->iov[0].iov_base = "TAKETHIS ";
+		c->iov[0].iov_len = 9;
+		c->iov[1].iov_base = c->slots[s].msgid;
+		c->iov[1].iov_len = strlen(c->slots[s].msgid);
+		c->iov[2].iov_base = "\r\n";
+		c->iov[2].iov_len = 2;
+		iovcnt = 3;
+		ui_nntp_command_issued(&c->tinfo, "TAKETHIS");
+	}
+	iovcnt += nntp_article_iov(c->iov + iovcnt, e->data,
+				   article->subject->data,
+				   (c->state == CONN_STREAMING) ?
+				   c->slots[s].msgid : NULL,
+				   c->slots[s].date,
+				   article->buffer, article->length);
+
+	/* the body is the entry before the terminator */
+	c->file_iov = NULL;
+	c->body_iov = NULL;
+	if (article->buffer == NULL) {
+		c->file_iov = &c->iov[iovcnt - 2];
+		c->file_fd = article->spool_fd;
+		c->file_length = article->length;
+	}
+	else
+		c->body_iov = &c->iov[iovcnt - 2];
+	c->slots[s].zc_until = c->zc_sent;
+
+	c->out = c->iov;
+	c->outcnt = iovcnt;
+	c->head = 0;
+	for (i = 0; i < iovcnt; i++)
+		c->head += c->iov[i].iov_len;
+	c->head -= article->length + 5;
+	c->body = article->length;
+	c->sending = s;
+	c->active_at = now_ms();
+	c->progress_at = c->active_at;
+
+	return conn_flush(e, c);
+}
+
+/* Writes as much of the output as the socket takes, or queues it on
+ * the ring.  Returns FALSE if the connection is gone. */
+static boolean conn_flush(engine *e, connection *c) {
+	struct iovec limited[NNTP_ARTICLE_IOV + 3];
+	struct iovec *iov, *body;
+	long written, length;
+	boolean zerocopy;
+	int count;
+
+	/* the ring only sends from memory, can't encrypt, and sends
+	   whole articles, which the bandwidth limit can't pace; it
+	   copies them too */
+	if ((e->ring != NULL) && !e->ring_failed && (c->file_iov == NULL) &&
+	    (e->rate == 0) && socket_kernel_sends(&c->tinfo) &&
+	    ((c->body_iov == NULL) || !c->zerocopy) && conn_submit(e, c))
+		return TRUE;
+
+	while (c->outcnt > 0) {
+		/* commands don't count towards the limit */
+		length = -1;
+		if ((e->rate > 0) && (c->sending >= 0)) {
+			if (c->allowance <= 0) {
+				limit_wait(e, c);
+				return TRUE;
+			}
+			length = c->allowance;
+		}
+
+		if (c->out == c->file_iov)
+			written = socket_sendfile(&c->tinfo, c->file_fd,
+				c->file_length - (long) c->out->iov_len,
+				((length >= 0) && (length < c->out->iov_len)) ?
+				length : c->out->iov_len);
+		else {
+			/* the body goes on its own if it goes zero-copy,
+			   unless there's so little left it's not worth it */
+			body = c->file_iov;
+			if (c->zerocopy && (c->body_iov != NULL) &&
+			    (c->body_iov->iov_len >= SOCKET_ZEROCOPY_MIN))
+				body = c->body_iov;
+			zerocopy = (c->out == body) && (body == c->body_iov);
+			count = c->outcnt;
+			if (zerocopy)
+				count = 1;
+			else if ((body > c->out) &&
+				 (body < c->out + c->outcnt))
+				count = body - c->out;
+			iov = c->out;
+			if (length >= 0) {
+				count = limit_iov(limited, c->out, count,
+						  length);
+				iov = limited;
+			}
+			if (zerocopy) {
+				written = socket_send_zerocopy(&c->tinfo, iov,
+							count, &c->zc_sent);
+				c->slots[c->sending].zc_until = c->zc_sent;
+			}
+			else
+				written = socket_send(&c->tinfo, iov, count);
+		}
+		if (written < 0) {
+			conn_lost(e, c);
+			return FALSE;
+		}
+		if (written == 0) {
+			poller_watch(e, c, WATCH_IN | WATCH_OUT);
+			return TRUE;
+		}
+		c->out = socket_iov_advance(c->out, &c->outcnt, written);
+		if (length >= 0)
+			c->allowance -= written;
+		conn_sent(c, written);
+	}
+
+	limit_leave(e, c);
+	c->sending = -1;
+	poller_watch(e, c, WATCH_IN);
+	return TRUE;
+}
+
+/* Queues what's left of the output on the ring, linked so it goes out
+ * in order: a sendmsg() for the headers, a write from the registered
+ * buffers for the body, and another sendmsg() for the terminator.  The
+ * ring has room for that on every connection.  conn_complete() carries
+ * on from there.  Returns FALSE if nothing could be queued. */
+static boolean conn_submit(engine *e, connection *c) {
+	struct msghdr *msg;
+	boolean queued = TRUE;
+	int i = 0, m = 0;
+	int start;
+
+	if (c->pending > 0)
+		return TRUE;
+
+	while (queued && (i < c->outcnt)) {
+		if (uring_fixed(e->ring, c->out[i].iov_base,
+				c->out[i].iov_len)) {
+			queued = uring_write(e->ring, c->tinfo.sockfd,
+					     c->out[i].iov_base,
+					     c->out[i].iov_len, c,
+					     i + 1 < c->outcnt);
+			i++;
+		}
+		else {
+			start = i;
+			while ((i < c->outcnt) &&
+			       !uring_fixed(e->ring, c->out[i].iov_base,
+					    c->out[i].iov_len))
+				i++;
+			msg = &c->msgs[m++];
+			memset(msg, 0, sizeof(*msg));
+			msg->msg_iov = c->out + start;
+			msg->msg_iovlen = i - start;
+			queued = uring_sendmsg(e->ring, c->tinfo.sockfd, msg, c,
+					       i < c->outcnt);
+		}
+		if (queued)
+			c->pending++;
+	}
+	if (c->pending == 0)
+		return FALSE;
+
+	poller_watch(e, c, WATCH_IN);
+	return TRUE;
+}
+
+/* counts what went out of the body towards the progress; any of it
+ * shows the socket isn't stuck */
+static void conn_sent(connection *c, long written) {
+	long body;
+
+	if (written > 0)
+		c->progress_at = now_ms();
+
+	body = written - c->head;
+	c->head -= written;
+	if (c->head < 0)
+		c->head = 0;
+	if (body > c->body)
+		body = c->body;
+	if (body > 0) {
+		c->body -= body;
+		pthread_rwlock_wrlock(c->tinfo.rwlock);
+		c->tinfo.bytes_written += body;
+		pthread_rwlock_unlock(c->tinfo.rwlock);
+		ui_chunk_posted(&c->tinfo, body, body);
+	}
+}
+
+/* A send queued on the ring is done.  Once they all are, what's left
+ * of the output (after a short send, or a full socket) is sent again. */
+static void conn_complete(void *user_data, int res, void *arg) {
+	engine *e = (engine *) arg;
+	connection *c = (connection *) user_data;
+	long sent;
+	int error;
+
+	c->pending--;
+	if (res > 0) {
+		c->sent += res;
+		conn_sent(c, res);
+	}
+	else if ((res < 0) && (res != -ECANCELED) && (c->error == 0))
+		c->error = -res;
+	if (c->pending > 0)
+		return;
+
+	sent = c->sent;
+	error = c->error;
+	c->sent = 0;
+	c->error = 0;
+
+	if (c->lost) {
+		c->lost = FALSE;
+		conn_lost(e, c);
+		return;
+	}
+	if (c->tinfo.sockfd < 0)
+		/* closed in the meantime */
+		return;
+
+	c->out = socket_iov_advance(c->out, &c->outcnt, sent);
+
+	if ((error == EINVAL) || (error == EOPNOTSUPP)) {
+		/* this kernel can't send this way after all */
+		e->ring_failed = TRUE;
+		conn_flush(e, c);
+	}
+	else if ((error == EAGAIN) || (error == EINTR) ||
+		 ((error == 0) && (sent == 0) && (c->outcnt > 0)))
+		poller_watch(e, c, WATCH_IN | WATCH_OUT);
+	else if (error != 0) {
+		ui_socket_error(error);
+		conn_lost(e, c);
+	}
+	else if (c->outcnt > 0)
+		conn_flush(e, c);
+	else
+		c->sending = -1;
+}
+
+/* the server answered for the article in s */
+static void conn_slot_done(engine *e, connection *c, slot *s, int result,
+			   const char *response) {
+	post_article_t *article = &s->article;
+
+	if (result == NORMAL) {
+		ui_posting_part_done(&c->tinfo, article->file_data,
+				     article->partnumber);
+
+		/* check if this part was the last one of a certain file */
+		pthread_rwlock_wrlock(article->file_data->rwlock);
+		if (++article->file_data->parts_posted ==
+		    article->file_data->parts_to_post)
+			ui_posting_file_done(e->data, article->file_data);
+		pthread_rwlock_unlock(article->file_data->rwlock);
+
+		server_posted(c->srv, article->length);
+		if (c->bound) {
+			c->src->articles++;
+			c->src->bytes += article->length;
+		}
+		c->attempts = 0;
+	}
+	else {
+		ui_nntp_posting_failed(&c->tinfo, response);
+		/* a rejected one would only be rejected again */
+		if ((result != ARTICLE_REJECTED) && retry_article(e, s, TRUE))
+			ui_nntp_posting_retry(&c->tinfo);
+		else
+			e->lost++;
+	}
+
+	conn_release(e, c, s);
+	s->in_flight = FALSE;
+	c->in_flight--;
+	server_busy(c->srv, -1);
+}
+
+/* lets go of the article in s, but keeps its buffer from the pool
+ * while the kernel may still be sending from it */
+static void conn_release(engine *e, connection *c, slot *s) {
+	if ((s->article.buffer != NULL) &&
+	    ((int) (s->zc_until - c->zc_done) > 0)) {
+		conn_reap(e, c);
+		if ((int) (s->zc_until - c->zc_done) > 0) {
+			c->held[c->nheld] = s->article.buffer;
+			c->held_until[c->nheld] = s->zc_until;
+			c->nheld++;
+			s->article.buffer = NULL;
+		}
+	}
+	release_article(e, &s->article);
+}
+
+/* Catches up on the MSG_ZEROCOPY sends the kernel is finished with,
+ * and gives the buffers that were waiting on them back to the pool. */
+static void conn_reap(engine *e, connection *c) {
+	boolean copied = FALSE;
+	int i;
+
+	if (c->zc_sent == c->zc_done)
+		return;
+	socket_zerocopy_done(c->tinfo.sockfd, &c->zc_done, &copied);
+	/* it copied them after all, e.g. over loopback; that's the
+	   usual way but slower */
+	if (copied)
+		c->zerocopy = FALSE;
+
+	for (i = 0; (i < c->nheld) &&
+		     ((int) (c->held_until[i] - c->zc_done) <= 0); i++)
+		buffer_pool_put(e->pool, c->held[i]);
+	c->nheld -= i;
+	memmove(c->held, c->held + i, c->nheld * sizeof(char *));
+	memmove(c->held_until, c->held_until + i,
+		c->nheld * sizeof(unsigned int));
+}
+
+/* The connection broke; the articles it had out go back in line for
+ * the others, and it connects and logs on again in the background,
+ * right away the first time and after a wait from then on. */
+static void conn_lost(engine *e, connection *c) {
+	boolean logged_on;
+	int s;
+
+	if (c->pending > 0) {
+		/* the ring still uses the buffers; make it let go first */
+		shutdown(c->tinfo.sockfd, SHUT_RDWR);
+		poller_watch(e, c, 0);
+		c->lost = TRUE;
+		return;
+	}
+
+	/* With several articles out, any of them may have broken it.
+	   None is blamed for it then; they go out again on their own
+	   (see conn_ready()), and the one that breaks a connection
+	   by itself is. */
+	for (s = 0; s < c->nslots; s++) {
+		if (!c->slots[s].in_flight)
+			continue;
+		c->slots[s].suspect = TRUE;
+		if (!retry_article(e, &c->slots[s], c->in_flight == 1)) {
+			ui_posting_part_lost(c->slots[s].article.file_data,
+					     c->slots[s].article.partnumber);
+			e->lost++;
+		}
+		release_article(e, &c->slots[s].article);
+		c->slots[s].in_flight = FALSE;
+	}
+	server_busy(c->srv, -c->in_flight);
+	c->in_flight = 0;
+
+	logged_on = (c->state >= CONN_MODE_STREAM);
+	conn_close(e, c, CONN_WAITING);
+	if (e->articles_done)
+		c->state = CONN_DONE;
+	else if (logged_on && (c->attempts++ == 0)) {
+		conn_status(c, THREAD_WAITING);
+		c->wake_at = now_ms();
+	}
+	else
+		/* it was the server, not the connection */
+		conn_failed(e, c);
+}
+
+/* Connecting or logging on didn't work.  The first failure since the
+ * server last let a connection log on, or the probe's, opens its
+ * breaker: all its connections wait, twice as long as the time before
+ * up to SOCKET_RECONNECT_WAIT_SECONDS, give or take half of that.  The
+ * others just wait along. */
+static void conn_failed(engine *e, connection *c) {
+	server *srv = c->srv;
+	long long wait;
+	int i;
+
+	if (srv->failures >= CONNECT_ATTEMPTS) {
+		/* the server was given up while this one was trying */
+		ui_connecting_too_many_failures(&c->tinfo);
+		conn_close(e, c, CONN_DONE);
+		return;
+	}
+	conn_status(c, THREAD_WAITING);
+	c->state = CONN_WAITING;
+	c->wake_at = 0;
+
+	if ((srv->breaker == BREAKER_OPEN) ||
+	    ((srv->breaker == BREAKER_PROBING) && (srv->probe != c)))
+		return;
+
+	srv->probe = NULL;
+	if (++srv->failures >= CONNECT_ATTEMPTS) {
+		for (i = 0; i < srv->nconns; i++)
+			if (srv->conns[i].state == CONN_WAITING) {
+				ui_connecting_too_many_failures(
+					&srv->conns[i].tinfo);
+				conn_close(e, &srv->conns[i], CONN_DONE);
+			}
+		return;
+	}
+
+	wait = SOCKET_RECONNECT_FIRST_WAIT_SECONDS * 1000LL;
+	for (i = 1; (i < srv->failures) &&
+		     (wait < SOCKET_RECONNECT_WAIT_SECONDS * 1000LL); i++)
+		wait *= 2;
+	if (wait > SOCKET_RECONNECT_WAIT_SECONDS * 1000LL)
+		wait = SOCKET_RECONNECT_WAIT_SECONDS * 1000LL;
+	wait = wait / 2 + rand_r(&e->seed) % (wait / 2 + 1);
+
+	srv->breaker = BREAKER_OPEN;
+	srv->retry_at = now_ms() + wait;
+}
+
+static void conn_close(engine *e, connection *c, int state) {
+	int i;
+
+	if (c->state == CONN_CONNECTING) {
+		poller_race(e, c, FALSE);
+		socket_race_end(&c->race);
+	}
+	if (c->tinfo.sockfd >= 0) {
+		poller_watch(e, c, 0);
+		socket_tls_end(&c->tinfo);
+		conn_reap(e, c);
+		if (c->zc_sent != c->zc_done)
+			/* the kernel still sends from buffers; this makes
+			   it stop */
+			socket_abort(c->tinfo.sockfd);
+		else
+			socket_close(c->tinfo.sockfd);
+		c->tinfo.sockfd = -1;
+	}
+	while (c->nheld > 0)
+		buffer_pool_put(e->pool, c->held[--c->nheld]);
+	for (i = 0; i < c->nslots; i++)
+		c->slots[i].zc_until = 0;
+	c->zerocopy = FALSE;
+	c->zc_sent = 0;
+	c->zc_done = 0;
+	limit_leave(e, c);
+	c->outcnt = 0;
+	c->file_iov = NULL;
+	c->body_iov = NULL;
+	c->sending = -1;
+	c->state = state;
+	if (state == CONN_DONE)
+		conn_status(c, THREAD_DONE);
+
+	if ((state == CONN_DONE) && (c->srv->probe == c)) {
+		/* e.g. its logon was refused: the next one tries now */
+		c->srv->probe = NULL;
+		c->srv->breaker = BREAKER_OPEN;
+		c->srv->retry_at = now_ms();
+	}
+}
+
+/* Takes on data->bandwidth, with a full bucket.  The connections in
+ * line just go ahead if there's no limit anymore. */
+static void limit_set(engine *e) {
+	connection *c;
+
+	e->rate = e->data->bandwidth;
+	e->burst = e->data->burst;
+	if (e->burst <= 0) {
+		/* a quarter of a second's worth */
+		e->burst = e->rate / 4;
+		if (e->burst < LIMIT_QUANTUM)
+			e->burst = LIMIT_QUANTUM;
+	}
+	e->tokens = e->burst;
+	e->filled_at = now_ms();
+
+	while ((e->rate == 0) && (e->throttled != NULL)) {
+		c = e->throttled;
+		limit_leave(e, c);
+		conn_flush(e, c);
+	}
+}
+
+/* Gives the connections in line their turns, first come first served,
+ * as far as the bucket goes.  Returns when it will have enough for the
+ * next one, or -1 if nobody is waiting. */
+static long long limit_serve(engine *e) {
+	connection *c;
+	long long now;
+	long need;
+	int i;
+
+	if (e->throttled == NULL)
+		return -1;
+
+	now = now_ms();
+	e->tokens += (now - e->filled_at) * (double) e->rate / 1000;
+	if (e->tokens > e->burst)
+		e->tokens = e->burst;
+	e->filled_at = now;
+
+	while ((c = e->throttled) != NULL) {
+		need = 0;
+		for (i = 0; i < c->outcnt; i++)
+			need += c->out[i].iov_len;
+		if (need > LIMIT_QUANTUM)
+			need = LIMIT_QUANTUM;
+		if (need > e->burst)
+			need = e->burst;
+		if (e->tokens < need)
+			return now + (long long)
+				((need - e->tokens) * 1000 / e->rate) + 1;
+
+		limit_leave(e, c);
+		c->allowance = need;
+		c->progress_at = now;
+		e->tokens -= need;
+		/* it gets back in line if there's more */
+		conn_flush(e, c);
+	}
+	return -1;
+}
+
+/* puts c at the back of the line for its next turn */
+static void limit_wait(engine *e, connection *c) {
+	if (!c->throttled) {
+		c->throttled = TRUE;
+		c->next_throttled = NULL;
+		if (e->last_throttled != NULL)
+			e->last_throttled->next_throttled = c;
+		else
+			e->throttled = c;
+		e->last_throttled = c;
+	}
+	poller_watch(e, c, WATCH_IN);
+}
+
+/* takes c out of line, and gives back what it didn't get to send */
+static void limit_leave(engine *e, connection *c) {
+	connection **p;
+	connection *prev = NULL;
+
+	if (c->throttled) {
+		for (p = &e->throttled; *p != c; p = &(*p)->next_throttled)
+			prev = *p;
+		*p = c->next_throttled;
+		if (e->last_throttled == c)
+			e->last_throttled = prev;
+		c->throttled = FALSE;
+	}
+
+	e->tokens += c->allowance;
+	if (e->tokens > e->burst)
+		e->tokens = e->burst;
+	c->allowance = 0;
+}
+
+/* copies the first length bytes' worth of iov into limited */
+static int limit_iov(struct iovec *limited, const struct iovec *iov,
+		     int count, long length) {
+	int i;
+
+	for (i = 0; (i < count) && (length > 0); i++) {
+		limited[i] = iov[i];
+		if (limited[i].iov_len > length)
+			limited[i].iov_len = length;
+		length -= limited[i].iov_len;
+	}
+	return i;
+}
+
+static void conn_status(connection *c, int status) {
+	pthread_rwlock_wrlock(c->tinfo.rwlock);
+	c->tinfo.status = status;
+	pthread_rwlock_unlock(c->tinfo.rwlock);
+}
+
+#ifdef ENGINE_EPOLL
+
+static boolean poller_init(engine *e) {
+	e->epfd = epoll_create(e->nconns + 1);
+	if (e->epfd < 0)
+		return FALSE;
+
+	e->wakeup[0] = eventfd(0, EFD_NONBLOCK);
+	if (e->wakeup[0] < 0) {
+		close(e->epfd);
+		return FALSE;
+	}
+	e->wakeup[1] = e->wakeup[0];
+	poller_watch(e, NULL, WATCH_IN);
+
+	return TRUE;
+}
+
+/* NULL is the wakeup */
+static void poller_watch(engine *e, connection *c, int watching) {
+	struct epoll_event event;
+	int op;
+
+	if (c == NULL) {
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->wakeup[0], &event);
+		return;
+	}
+	if (watching == c->watching)
+		return;
+
+	event.events = 0;
+	if (watching & WATCH_IN)
+		event.events |= EPOLLIN;
+	if (watching & WATCH_OUT)
+		event.events |= EPOLLOUT;
+	event.data.ptr = c;
+
+	if (c->watching == 0)
+		op = EPOLL_CTL_ADD;
+	else if (watching == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+	epoll_ctl(e->epfd, op, c->tinfo.sockfd, &event);
+
+	c->watching = watching;
+}
+
+/* Watches the connects c is racing, or stops watching them before
+ * socket_race_check() or socket_race_next() change them */
+static void poller_race(engine *e, connection *c, boolean watching) {
+	struct epoll_event event;
+	int i;
+
+	event.events = EPOLLOUT;
+	event.data.ptr = c;
+	for (i = 0; i < SOCKET_RACE; i++)
+		if (c->race.fds[i] >= 0)
+			epoll_ctl(e->epfd, watching ? EPOLL_CTL_ADD :
+				  EPOLL_CTL_DEL, c->race.fds[i], &event);
+}
+
+static int poller_wait(engine *e, connection **conns, int *events, int timeout) {
+	struct epoll_event ev[ENGINE_MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(e->epfd, ev, ENGINE_MAX_EVENTS, timeout);
+	for (i = 0; i < n; i++) {
+		conns[i] = (connection *) ev[i].data.ptr;
+		events[i] = 0;
+		/* errors and hangups show up when reading or writing */
+		if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			events[i] |= WATCH_IN;
+		if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			events[i] |= WATCH_OUT;
+	}
+	return (n < 0) ? 0 : n;
+}
+
+static void poller_free(engine *e) {
+	close(e->wakeup[0]);
+	close(e->epfd);
+}
+
+#else /* ENGINE_EPOLL */
+
+static boolean poller_init(engine *e) {
+	int i;
+
+	if (pipe(e->wakeup) < 0)
+		return FALSE;
+	fcntl(e->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(e->wakeup[1], F_SETFL, O_NONBLOCK);
+
+	e->pollfds = (struct pollfd *) calloc(
+		e->nconns * (SOCKET_RACE + 1) + 1, sizeof(struct pollfd));
+	e->pollfds[0].fd = e->wakeup[0];
+	e->pollfds[0].events = POLLIN;
+	for (i = 1; i <= e->nconns * (SOCKET_RACE + 1); i++)
+		e->pollfds[i].fd = -1;
+
+	return TRUE;
+}
+
+static void poller_watch(engine *e, connection *c, int watching) {
+	struct pollfd *p = &e->pollfds[c->index + 1];
+
+	p->fd = (watching != 0) ? c->tinfo.sockfd : -1;
+	p->events = 0;
+	if (watching & WATCH_IN)
+		p->events |= POLLIN;
+	if (watching & WATCH_OUT)
+		p->events |= POLLOUT;
+	c->watching = watching;
+}
+
+static void poller_race(engine *e, connection *c, boolean watching) {
+	struct pollfd *p;
+	int i;
+
+	p = &e->pollfds[e->nconns + 1 + c->index * SOCKET_RACE];
+	for (i = 0; i < SOCKET_RACE; i++) {
+		p[i].fd = watching ? c->race.fds[i] : -1;
+		p[i].events = POLLOUT;
+	}
+}
+
+static int poller_wait(engine *e, connection **conns, int *events, int timeout) {
+	struct pollfd *p;
+	int count = e->nconns * (SOCKET_RACE + 1) + 1;
+	int i, n = 0;
+
+	if (poll(e->pollfds, count, timeout) <= 0)
+		return 0;
+
+	for (i = 0; (i < count) && (n < ENGINE_MAX_EVENTS); i++) {
+		p = &e->pollfds[i];
+		if ((p->fd < 0) || (p->revents == 0))
+			continue;
+		if (i == 0)
+			conns[n] = NULL;
+		else if (i <= e->nconns)
+			conns[n] = &e->conns[i - 1];
+		else
+			conns[n] = &e->conns[(i - e->nconns - 1) / SOCKET_RACE];
+		events[n] = 0;
+		if (p->revents & (POLLIN | POLLERR | POLLHUP))
+			events[n] |= WATCH_IN;
+		if (p->revents & (POLLOUT | POLLERR | POLLHUP))
+			events[n] |= WATCH_OUT;
+		n++;
+	}
+	return n;
+}
+
+static void poller_free(engine *e) {
+	close(e->wakeup[0]);
+	close(e->wakeup[1]);
+	free(e->pollfds);
+}
+
+#endif /* ENGINE_EPOLL */
+
+static long long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
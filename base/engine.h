@@ -0,0 +1,13 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include "newspost.h"
+#include "queue.h"
+
+typedef struct engine_s engine;
+
+engine *engine_start(newspost_data *data, queue *ready, buffer_pool *pool);
+int engine_finish(engine *e);
+
+#endif /* __ENGINE_H__ */
@@ -23,6 +23,7 @@
 #include <sys/time.h>
 #include "newspost.h"
 #include "queue.h"
+#include "engine.h"
 #include "../ui/ui.h"
 #include "socket.h"
 #include "nntp.h"
@@ -36,20 +37,20 @@
 
 typedef struct {
 	newspost_data *data;
-	newspost_threadinfo *threadinfo;
 	queue *fifo;
+	queue *ready;
+	buffer_pool *pool;
 }
-poster_thread_arg;
+encoder_thread_arg;
 
 static int post_text_file(newspost_data *data, SList *file_list);
 
-static int encode_and_post(newspost_data *data, SList *file_list,
-			    SList *parfiles);
+static int encode_and_post(newspost_data *data, SList *file_list);
 
 static void post_file(newspost_data *data, queue *fifo, file_entry *file_data,
 		      int filenumber, int number_of_files, const char *filestring);
 
-static void *poster_thread(void *arg);
+static void *encoder_thread(void *arg);
 
 static Buff *make_subject(Buff *subject, newspost_data *data,
 	int filenumber, int number_of_files, const char *filename,
@@ -64,22 +65,16 @@ static Buff *read_text_file(Buff * text_buffer, const char *filename);
 **/
 
 int newspost(newspost_data *data, SList *file_list) {
-	int retval;
-	SList *parfiles = NULL;
-
-	/* preprocess */
 	if (data->text == FALSE)
-		parfiles = preprocess(data, file_list);
+		/* it does the preprocessing itself, while it connects */
+		return encode_and_post(data, file_list);
 
-	/* and post! */
-	ui_post_start(data, file_list, parfiles);
+	nntp_make_header(data);
 
-	if (data->text == TRUE)
-		retval = post_text_file(data, file_list);
-	else
-		retval = encode_and_post(data, file_list, parfiles);
+	/* and post! */
+	ui_post_start(data, file_list, NULL);
 
-	return retval;
+	return post_text_file(data, file_list);
 }
 
 
@@ -106,12 +101,26 @@ static int post_text_file(newspost_data *data, SList *file_list) {
 	retval = tinfo.sockfd;
 	if (retval < 0)
 		return retval;
+	tinfo.tls = NULL;
+	socket_buffer_init(&tinfo.input);
+
+	/* the socket blocks, so the handshake is done in one go */
+	if ((data->tls == TRUE) &&
+	    ((socket_tls_start(&tinfo, data->address->data) != NORMAL) ||
+	     (socket_tls_handshake(&tinfo) != NORMAL))) {
+		socket_tls_end(&tinfo);
+		socket_close(tinfo.sockfd);
+		return TLS_FAILED;
+	}
 
 	ui_socket_connect_done(&tinfo);
+	if (data->tls == TRUE)
+		ui_tls_started(&tinfo, socket_kernel_sends(&tinfo));
 
 	/* log on to the server */
 	ui_nntp_logon_start(&tinfo, data->address->data);
 	if (nntp_logon(&tinfo, data) == FALSE) {
+		socket_tls_end(&tinfo);
 		socket_close(tinfo.sockfd);
 		return LOGON_FAILED;
 	}
@@ -123,6 +132,8 @@ static int post_text_file(newspost_data *data, SList *file_list) {
 	if(text_buffer != NULL)
 		retval = nntp_post(&tinfo, data->subject->data, data, text_buffer->data,
 					text_buffer->length, TRUE);
+	socket_tls_end(&tinfo);
+	socket_close(tinfo.sockfd);
 
 	pthread_rwlock_destroy(tinfo.rwlock);
 	free(tinfo.rwlock);
@@ -131,52 +142,88 @@ static int post_text_file(newspost_data *data, SList *file_list) {
 	return retval;
 }
 
-/* Binary Posting (thread-based): */
-static int encode_and_post(newspost_data *data, SList *file_list,
-			    SList *parfiles) {
+/* Binary Posting (thread-based):
+ * the main thread queues the articles in fifo, a pool of encoder threads
+ * (one per CPU) encodes them into buffers from pool and queues them in
+ * ready, and the engine's thread sends them over all the connections.
+ * The engine starts first, so the connections log on while the CRCs,
+ * SFV and PAR files are made and the countdown runs. */
+static int encode_and_post(newspost_data *data, SList *file_list) {
 	int number_of_files;
 	int i, j;
+	int encoders;
 	file_entry *file_data = NULL;
+	file_entry *sfv_data = NULL;
 	int retval = NORMAL;
-	pthread_t *thread_array =
-		(pthread_t *) malloc(data->threads * sizeof(pthread_t));
-	newspost_threadinfo *threadinfo_array =
-		(newspost_threadinfo *) malloc(data->threads * sizeof(newspost_threadinfo));
-	poster_thread_arg *poster_args =
-		(poster_thread_arg *) malloc(data->threads * sizeof(poster_thread_arg));
-	queue *fifo;
+	pthread_t *encoder_array;
+	encoder_thread_arg encoder_args;
+	queue *fifo, *ready;
+	buffer_pool *pool;
+	engine *e;
+	SList *parfiles;
+	SList *listptr;
+	int connections;
+
+	encoders = sysconf(_SC_NPROCESSORS_ONLN);
+	if (encoders < 1)
+		encoders = 1;
+	encoder_array = (pthread_t *) malloc(encoders * sizeof(pthread_t));
+
+	/* the engine connects to every server given with -H as well */
+	connections = data->threads;
+	for (listptr = data->servers; listptr != NULL;
+	     listptr = slist_next(listptr))
+		connections += ((newspost_server *) listptr->data)->threads;
+
+	fifo = queue_init(encoders * 2);
+	ready = queue_init(connections * 2);
+
+	/* enough buffers for a full ready queue plus those on every connection */
+	pool = buffer_pool_init(ready->length + encoders +
+				connections * ((data->stream > 1) ?
+					       data->stream : 1),
+				get_buffer_size_per_encoded_part(data));
+
+	/* the engine must be listening on ready before the encoders start */
+	e = engine_start(data, ready, pool);
+	if (e == NULL) {
+		ui_generic_error(errno);
+		queue_delete(fifo);
+		queue_delete(ready);
+		buffer_pool_delete(pool);
+		free(encoder_array);
+		return FAILED_TO_CREATE_SOCKET;
+	}
 
-	fifo = queue_init(data->threads * 2);
+	/* the engine doesn't look at the headers before there's an
+	   article, so they can still change */
+	parfiles = preprocess(data, file_list);
 
-	for(j = 0; j < data->threads; j++) {
-		/* set the thread's local data */
-		threadinfo_array[j].thread_id = j+1;
-		threadinfo_array[j].status = THREAD_INITIALIZING;
-		threadinfo_array[j].bytes_written = 0;
-		threadinfo_array[j].rwlock = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t));
-		pthread_rwlock_init(threadinfo_array[j].rwlock, NULL);
+	/* the From line is final now */
+	nntp_make_header(data);
 
-		poster_args[j].data = data;
-		poster_args[j].threadinfo = &threadinfo_array[j];
-		poster_args[j].fifo = fifo;
+	/* and post! */
+	ui_post_start(data, file_list, parfiles);
 
-		/* create a poster thread */
-		pthread_create(&thread_array[j], NULL, poster_thread, &poster_args[j]);
-	}
+	encoder_args.data = data;
+	encoder_args.fifo = fifo;
+	encoder_args.ready = ready;
+	encoder_args.pool = pool;
+	for (j = 0; j < encoders; j++)
+		pthread_create(&encoder_array[j], NULL, encoder_thread, &encoder_args);
 
 	/* post any sfv files... */
 	if (data->sfv != NULL) {
-		file_data = file_entry_alloc(file_data);
-		file_data->filename =
-			buff_create(file_data->filename, "%s", data->sfv->data);
-		if (stat(data->sfv->data, &file_data->fileinfo) == -1)
+		sfv_data = file_entry_alloc();
+		sfv_data->filename =
+			buff_create(sfv_data->filename, "%s", data->sfv->data);
+		sfv_data->generated = TRUE;
+		if (stat(data->sfv->data, &sfv_data->fileinfo) == -1) {
 			ui_sfv_gen_error(data->sfv->data, errno);
-		else {
-			post_file(data, fifo, file_data, 1, 1, "SFV File");
-
-			unlink(data->sfv->data);
+			sfv_data = file_entry_free(sfv_data);
 		}
-		free(file_data);
+		else
+			post_file(data, fifo, sfv_data, 1, 1, "SFV File");
 	}
 
 	number_of_files = slist_length(file_list);
@@ -200,50 +247,44 @@ static int encode_and_post(newspost_data *data, SList *file_list,
 	while (file_list != NULL) {
 
 		file_data = (file_entry *) file_list->data;
+		file_data->generated = TRUE;
 
 		post_file(data, fifo, file_data, i, number_of_files, "PAR File");
 
-		unlink(file_data->filename->data);
-		buff_free(file_data->filename);
-		free(file_data);
 		i++;
 		file_list = slist_next(file_list);
 	}
-	slist_free(parfiles);
 
-	/* Signal that there will no new items be written to the queue */
-	pthread_mutex_lock(fifo->mut);
-	fifo->producer_done = TRUE;
-	pthread_mutex_unlock(fifo->mut);
+	/* no new items will be written to the queue */
+	queue_finish(fifo);
 
-	/* Signal that the producer is done */
-	pthread_cond_broadcast(fifo->cond_producer_done);
+	for (j = 0; j < encoders; j++)
+		pthread_join(encoder_array[j], NULL);
 
-	/* Wait for the poster threads to clear the queue */
-	pthread_mutex_lock(fifo->mut);
-	pthread_cond_wait(fifo->cond_empty, fifo->mut);
-	pthread_mutex_unlock(fifo->mut);
+	/* every article is encoded; the encoders were the ready queue's producers */
+	queue_finish(ready);
 
-	/* wake-up sleeping threads so they can exit */
-	pthread_cond_broadcast(fifo->cond_not_empty);
+	retval = engine_finish(e);
 
-	for(j = 0; j < data->threads; j++) {
-		pthread_rwlock_rdlock(threadinfo_array[j].rwlock);
-		if (threadinfo_array[j].status == THREAD_CONNECTING)
-			pthread_cancel(thread_array[j]);
-		pthread_rwlock_unlock(threadinfo_array[j].rwlock);
+	/* the engine is done with the sfv and par files */
+	if (sfv_data != NULL) {
+		unlink(data->sfv->data);
+		file_entry_free(sfv_data);
+	}
 
-		pthread_join(thread_array[j], NULL);
+	file_list = parfiles;
+	while (file_list != NULL) {
+		file_data = (file_entry *) file_list->data;
+		unlink(file_data->filename->data);
+		file_entry_free(file_data);
+		file_list = slist_next(file_list);
 	}
+	slist_free(parfiles);
 
 	queue_delete(fifo);
-	for(j = 0; j < data->threads; j++) {
-		pthread_rwlock_destroy(threadinfo_array[j].rwlock);
-		free(threadinfo_array[j].rwlock);
-	}
-	free(threadinfo_array);
-	free(poster_args);
-	free(thread_array);
+	queue_delete(ready);
+	buffer_pool_delete(pool);
+	free(encoder_array);
 
 	return retval;
 }
@@ -260,6 +301,15 @@ static void post_file(newspost_data *data, queue *fifo, file_entry *file_data,
 		if(file_data->parts[0] == TRUE) return;
 	}
 
+	/* map the file once; all threads encode from the mapping */
+	file_entry_map(file_data);
+
+	/* generated files (sfv, par) haven't been counted yet */
+	if (file_data->number_enc_parts == 0) {
+		file_data->number_enc_parts = number_of_parts;
+		file_data->parts_to_post = number_of_parts;
+	}
+
 	for (j = 1; j <= number_of_parts; j++) {
 
 		if ((file_data->parts != NULL) &&
@@ -273,6 +323,9 @@ static void post_file(newspost_data *data, queue *fifo, file_entry *file_data,
 		article.file_data = file_data;
 		article.partnumber = j;
 		article.subject = subject;
+		article.buffer = NULL;
+		article.spool_fd = -1;
+		article.length = 0;
 
 		/* Add item to queue */
 		pthread_mutex_lock(fifo->mut);
@@ -289,96 +342,26 @@ static void post_file(newspost_data *data, queue *fifo, file_entry *file_data,
 	return;
 }
 
-static void *poster_thread(void *arg)
+static void *encoder_thread(void *arg)
 {
 	/* readability */
-	poster_thread_arg *arguments = (poster_thread_arg *) arg;
+	encoder_thread_arg *arguments = (encoder_thread_arg *) arg;
 
 	newspost_data *data = arguments->data;
-	newspost_threadinfo *tinfo = arguments->threadinfo;
 	queue *fifo = arguments->fifo;
+	queue *ready = arguments->ready;
+	buffer_pool *pool = arguments->pool;
 
-	/* variable declaration/definition */
 	post_article_t article;
-	char *data_buffer;
-
-	int total_failures = 0;
-	int number_of_tries = 0;
-
 	int retval;
 
-	int number_of_bytes;
-
-	struct timespec   ts;
-	struct timeval    tp;
-
-	tinfo->sockfd = -1;
-
 	/* initialize */
 	article.file_data = NULL;
 	article.partnumber = -1;
 	article.subject = NULL;
-
-	pthread_rwlock_wrlock(tinfo->rwlock);
-	tinfo->status = THREAD_CONNECTING;
-	pthread_rwlock_unlock(tinfo->rwlock);
-
-	/* create the socket */
-	while (tinfo->sockfd < 0) {
-		ui_socket_connect_start(tinfo, data->address->data);
-		tinfo->sockfd = socket_create(data->address->data, data->port);
-
-		if (tinfo->sockfd >= 0)
-			break;
-
-		ui_socket_connect_failed(tinfo, tinfo->sockfd);
-
-		gettimeofday(&tp, NULL);
-
-		/* Convert from timeval to timespec */
-		ts.tv_sec  = tp.tv_sec;
-		ts.tv_nsec = tp.tv_usec * 1000;
-		ts.tv_sec += SOCKET_RECONNECT_WAIT_SECONDS;
-
-		number_of_tries++;
-
-		if (number_of_tries >= 5) {
-			ui_connecting_too_many_failures(tinfo);
-			pthread_exit(NULL);
-		}
-		pthread_mutex_lock(fifo->mut);
-
-		while(!fifo->producer_done) {
-			retval = pthread_cond_timedwait(fifo->cond_producer_done, fifo->mut, &ts);
-			if (retval == ETIMEDOUT || retval == 0)
-				break;
-		}
-
-		/* quit if the producer signalled it was done */
-		if (fifo->producer_done) {
-			pthread_mutex_unlock(fifo->mut);
-			pthread_exit(NULL);
-		}
-		pthread_mutex_unlock(fifo->mut);
-	}
-	ui_socket_connect_done(tinfo);
-
-	pthread_rwlock_wrlock(tinfo->rwlock);
-	tinfo->status = THREAD_POSTING;
-	pthread_rwlock_unlock(tinfo->rwlock);
-
-	number_of_tries = 0;
-
-	/* log on to the server */
-	ui_nntp_logon_start(tinfo, data->address->data);
-	if (nntp_logon(tinfo, data) == FALSE) {
-		socket_close(tinfo->sockfd);
-		pthread_exit(NULL);
-	}
-	ui_nntp_logon_done(tinfo);
-
-	/* allocate the buffer */
-	data_buffer = (char *) malloc(get_buffer_size_per_encoded_part(data));
+	article.buffer = NULL;
+	article.spool_fd = -1;
+	article.length = 0;
 
 	while (TRUE) {
 		pthread_mutex_lock(fifo->mut);
@@ -389,63 +372,54 @@ static void *poster_thread(void *arg)
 
 		pthread_mutex_unlock(fifo->mut);
 
-		if (retval == QUEUE_PRODUCER_DONE) {
-			pthread_cond_broadcast(fifo->cond_empty);
+		if (retval == QUEUE_PRODUCER_DONE)
 			break;
-		}
 
 		pthread_cond_signal(fifo->cond_not_full);
 
-		number_of_bytes = get_encoded_part(data, article.file_data, article.partnumber, data_buffer);
-
-		if (article.partnumber == 1)
-			ui_posting_file_start(data, article.file_data);
-
-		ui_posting_part_start(tinfo, article.file_data, article.partnumber);
+		/* an earlier run may have encoded it already */
+		article.buffer = NULL;
+		article.spool_fd = -1;
+		if (data->spooldir != NULL)
+			article.spool_fd = get_spooled_part(data,
+				article.file_data, article.partnumber,
+				&article.length);
+
+		if (article.spool_fd < 0) {
+			article.length = -1;
+			article.buffer = buffer_pool_get(pool);
+			if (article.buffer == NULL)
+				ui_generic_error(ENOMEM);
+			else
+				article.length = get_encoded_part(data,
+					article.file_data, article.partnumber,
+					article.buffer);
+
+			if (article.length < 0) {
+				if (article.buffer != NULL)
+					buffer_pool_put(pool, article.buffer);
+				article.buffer = NULL;
+			}
+			else if (data->spooldir != NULL)
+				spool_encoded_part(data, article.file_data,
+					article.partnumber, article.buffer,
+					article.length);
+		}
 
-		retval = nntp_post(tinfo, article.subject->data, data, data_buffer, number_of_bytes, FALSE);
+		/* hand it to the engine, which counts it as lost if it
+		   couldn't be encoded */
+		pthread_mutex_lock(ready->mut);
+		while (ready->full)
+			pthread_cond_wait(ready->cond_not_full, ready->mut);
 
-		if (retval == NORMAL) {
-			ui_posting_part_done(tinfo, article.file_data, article.partnumber);
+		queue_item_add(ready, &article);
 
-			/* check if this part was the last one of a certain file */
-			pthread_rwlock_wrlock(article.file_data->rwlock);
-			if (++article.file_data->parts_posted == article.file_data->parts_to_post)
-				ui_posting_file_done(data, article.file_data);
-			pthread_rwlock_unlock(article.file_data->rwlock);
-		}
-		else if (retval == POSTING_NOT_ALLOWED)
-			return NULL;
-		else {
-			if (number_of_tries < 5) {
-				ui_nntp_posting_retry(tinfo);
-				sleep(5);
-				number_of_tries++;
-				continue;
-			}
-			else {
-				total_failures++;
-				if (total_failures == 5) {
-					nntp_logoff(tinfo);
-					socket_close(tinfo->sockfd);
-					ui_posting_too_many_failures(tinfo);
-				}
-			}
-		}
-		number_of_tries = 0;
+		pthread_mutex_unlock(ready->mut);
+		pthread_cond_signal(ready->cond_not_empty);
 	}
 
-	nntp_logoff(tinfo);
-	socket_close(tinfo->sockfd);
-
 	buff_free(article.subject);
-	free(data_buffer);
 
-	pthread_rwlock_wrlock(tinfo->rwlock);
-	tinfo->status = THREAD_DONE;
-	pthread_rwlock_unlock(tinfo->rwlock);
-
-	pthread_exit(NULL);
 	return NULL;
 }
 
@@ -486,20 +460,16 @@ static SList *preprocess(newspost_data *data, SList *file_list) {
 		buff_free(tmpstring);
 	}
 
-	/* calculate CRCs if needed; generate any sfv files */
-	if ((data->uuenc == FALSE) || (data->sfv != NULL)) {
+	/* calculate CRCs for any sfv files; yencoding doesn't need
+	 * them up front, it puts them together from the part CRCs */
+	if (data->sfv != NULL) {
 		calculate_crcs(file_list);
-
-		if (data->sfv != NULL)
-			newsfv(file_list, data);
+		newsfv(file_list, data);
 	}
 
 	/* generate any par files */
-	if (data->par != NULL) {
+	if (data->par != NULL)
 		parfiles = par_newspost_interface(data, file_list);
-		if (data->uuenc == FALSE)
-			calculate_crcs(parfiles);
-	}
 
 	return parfiles;
 }
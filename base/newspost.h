@@ -8,7 +8,19 @@
 
 #define SLEEP_TIME 10 /* time to pause before posting in seconds */
 
-#define SOCKET_RECONNECT_WAIT_SECONDS 120 /* time to wait between connect retries */
+#define SOCKET_RECONNECT_FIRST_WAIT_SECONDS 1 /* after a failed connect, doubled each time */
+
+#define SOCKET_RECONNECT_WAIT_SECONDS 120 /* the longest wait between connect retries */
+
+#define SPOOL_KEEP_DAYS 7 /* spooled articles not posted again for this long are removed */
+
+#define NNTP_KEEPALIVE_SECONDS 30 /* an idle connection sends DATE this often */
+
+#define SOCKET_CONNECT_TIMEOUT_SECONDS 30 /* to connect, with TLS if need be */
+
+#define SOCKET_SEND_TIMEOUT_SECONDS 60 /* a send that gets nowhere */
+
+#define NNTP_RESPONSE_TIMEOUT_SECONDS 120 /* to answer a command or article */
 
 /* #define ALLOW_NO_SUBJECT */ /* makes the subject line optional */
 
@@ -16,11 +28,16 @@
 
 /* #define REPORT_ONLY_FULLPARTS */ /* limit update of KBps display */
 
+/* #define NO_SIMD */ /* don't use SSE/AVX versions of the encoders */
+
+/* #define NO_URING */ /* send with sendmsg() even where io_uring works */
+
 /***********************************/
 /* END OF CONFIGURABLE DEFINITIONS */
 /***********************************/
 
 #include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -41,6 +58,7 @@
 #define USER_AGENT NEWSPOSTNAME "/" VERSION " (" NEWSPOSTURL ")"
 
 #define STRING_BUFSIZE 1024
+#define SOCKET_BUFSIZE 4096	/* bytes read from the server at a time */
 
 #define NORMAL 0
 #define FAILED_TO_CREATE_TMPFILES -1
@@ -49,6 +67,9 @@
 #define LOGON_FAILED -4
 #define POSTING_NOT_ALLOWED -5
 #define POSTING_FAILED -6
+#define ARTICLE_REJECTED -7
+#define TLS_FAILED -8
+#define TLS_REFUSED -9 /* e.g. the certificate doesn't check out */
 
 #define THREAD_INITIALIZING 0
 #define THREAD_CONNECTING 1
@@ -56,6 +77,23 @@
 #define THREAD_POSTING 3
 #define THREAD_DONE 4
 
+/* a server to post to besides data->address, from -H */
+typedef struct {
+	Buff * address;
+	int port;			/* 0 for the same default as -z */
+	Buff * user;
+	Buff * password;
+	int threads;			/* 0 for as many as -N */
+}
+newspost_server;
+
+/* a local address to connect from, from -I */
+typedef struct {
+	Buff * address;
+	int weight;			/* its share of the connections */
+}
+newspost_source;
+
 typedef struct {
 	Buff * subject;
 	Buff * newsgroup;
@@ -63,10 +101,27 @@ typedef struct {
 	Buff * organization;
 	Buff * address;	/* server address and port */
 	int port;
+	boolean tls;			/* connect with TLS (NNTPS) */
 	Buff * user;
 	Buff * password;
 	int threads;
+	SList * servers;	/* more newspost_servers to post to */
+	SList * sources;	/* newspost_sources to connect from */
+	int stream;			/* TAKETHIS window, 0 to POST */
+	long bandwidth;			/* bytes per second, 0 for no limit */
+	long burst;			/* bytes it may save up, 0 for the default */
+	volatile sig_atomic_t bandwidth_changed; /* in .newspostrc */
+	int connect_timeout;		/* seconds, 0 to wait forever */
+	int send_timeout;
+	int response_timeout;
+	boolean zerocopy;		/* send bodies with MSG_ZEROCOPY */
 	int lines;			/* lines per message */
+	int linelength;			/* characters per yEnc line */
+	long article_size;		/* or the article size to aim for */
+	long part_size;			/* or the bytes of the file per part */
+	boolean page_align;		/* make part_size a multiple of pages */
+	boolean spool;			/* keep encoded articles */
+	Buff * spooldir;	/* where they are kept */
 	boolean uuenc;
 	Buff * sfv;	/* filename for generated sfv file */
 	Buff * par;	/* prefix filename for par file(s) */
@@ -81,12 +136,24 @@ typedef struct {
 	Buff * name;
 	boolean text;
 	SList * extra_headers;
+	Buff * header;	/* the headers every article gets, but Subject */
+	long subject_offset;	/* where in header the Subject goes */
 }
 newspost_data;
 
+/* what has been read from a connection but not handed out yet */
+typedef struct {
+	long start;
+	long end;
+	char data[SOCKET_BUFSIZE];
+}
+socket_buffer;
+
 typedef struct {
 	int thread_id;
 	int sockfd;
+	void *tls;	/* its SSL, if the connection is encrypted */
+	socket_buffer input;
 
 	/* only the following properties need locking */
 	pthread_rwlock_t *rwlock;
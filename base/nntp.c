@@ -22,6 +22,13 @@
 #include "../ui/ui.h"
 #include "socket.h"
 
+/**
+*** Private Declarations
+**/
+
+static long send_article(newspost_threadinfo *tinfo, struct iovec *iov,
+			 int iovcnt, long length, boolean no_ui_updates);
+
 /**
 *** Public Routines
 **/
@@ -29,14 +36,14 @@
 boolean nntp_logon(newspost_threadinfo *tinfo, newspost_data *data) {
 	char buffer[STRING_BUFSIZE];
 
-	if (nntp_get_response(tinfo, buffer) < 0)
+	if (nntp_get_response(tinfo, buffer) <= 0)
 		return FALSE;
 
 	if (data->user != NULL) {
 		sprintf(buffer, "AUTHINFO USER %s", data->user->data);
 		if (nntp_issue_command(tinfo, buffer) < 0)
 			return FALSE;
-		if (nntp_get_response(tinfo, buffer) < 0)
+		if (nntp_get_response(tinfo, buffer) <= 0)
 			return FALSE;
 		/* 381: More Authentication required */
 		if (strncmp(buffer,
@@ -44,7 +51,7 @@ boolean nntp_logon(newspost_threadinfo *tinfo, newspost_data *data) {
 			sprintf(buffer, "AUTHINFO PASS %s", data->password->data);
 			if (nntp_issue_command(tinfo, buffer) < 0)
 				return FALSE;
-			if (nntp_get_response(tinfo, buffer) < 0)
+			if (nntp_get_response(tinfo, buffer) <= 0)
 				return FALSE;
 			if (strncmp(buffer,
 			    NTTP_AUTHENTICATION_UNSUCCESSFUL, 3) == 0) {
@@ -75,33 +82,16 @@ void nntp_logoff(newspost_threadinfo *tinfo) {
 	nntp_get_response(tinfo, tmpbuffer);
 }
 
-int nntp_post(newspost_threadinfo *tinfo, const char *subject, newspost_data *data,
-	      const char *buffer, long length,
-	      boolean no_ui_updates) {
-	char response[STRING_BUFSIZE];
-	const char *pi;
-	long i, chunksize;
+/* Builds the headers that are the same for every article, once; only
+ * the Subject line is filled in per article, at subject_offset. */
+void nntp_make_header(newspost_data *data) {
 	SList * listptr;
 	Buff * buff = NULL;
 	Buff * tmpbuff = NULL;
-	int sockfd = tinfo->sockfd;
-
-	nntp_issue_command(tinfo, "POST");
 
-	nntp_get_response(tinfo, response);
-
-	if (strncmp(response, NNTP_POSTING_NOT_ALLOWED, 3) == 0)
-		return POSTING_NOT_ALLOWED;
-
-	if (strncmp(response, NNTP_PROCEED_WITH_POST, 3) != 0) {
-		/* this shouldn't really happen */
-		ui_nntp_unknown_response(tinfo, response);
-		return POSTING_FAILED;
-	}
-	
 	buff = buff_add(buff, "From: %s\r\n", data->from->data);
 	buff = buff_add(buff, "Newsgroups: %s\r\n", data->newsgroup->data);
-	buff = buff_add(buff, "Subject: %s\r\n", subject);
+	data->subject_offset = buff->length;
 	buff = buff_add(buff, "User-Agent: %s\r\n", USER_AGENT);
 
 	if (data->replyto != NULL) {
@@ -126,39 +116,40 @@ int nntp_post(newspost_threadinfo *tinfo, const char *subject, newspost_data *da
 	}
 	buff = buff_add(buff,"\r\n");
 
-	socket_write(sockfd, buff->data, buff->length);
+	buff_free(data->header);
+	data->header = buff;
+}
+
+/* The headers, body and terminator go out in a single writev() */
+int nntp_post(newspost_threadinfo *tinfo, const char *subject, newspost_data *data,
+	      const char *buffer, long length,
+	      boolean no_ui_updates) {
+	char response[STRING_BUFSIZE];
+	struct iovec iov[NNTP_ARTICLE_IOV];
+	int iovcnt;
 
-	if (!no_ui_updates)
-		ui_chunk_posted(tinfo, 0, 0);
+	nntp_issue_command(tinfo, "POST");
 
-	pi = buffer;
-	i = 0;
-	chunksize = 32768;
-	while ((length - i) > chunksize) {
-		socket_write(sockfd, pi, chunksize);
-		i += chunksize;
-		pi += chunksize;
-		pthread_rwlock_wrlock(tinfo->rwlock);
-		tinfo->bytes_written += chunksize;
-		pthread_rwlock_unlock(tinfo->rwlock);
-#ifndef REPORT_ONLY_FULLPARTS
-		if (!no_ui_updates)
-			chunksize = ui_chunk_posted(tinfo, chunksize, i);
-#endif
-	}
-	socket_write(sockfd, pi, (length - i));
-	i += (length - i);
+	if (nntp_get_response(tinfo, response) <= 0)
+		return POSTING_FAILED;
 
-	socket_write(sockfd, "\r\n.\r\n", 5);
+	if (strncmp(response, NNTP_POSTING_NOT_ALLOWED, 3) == 0)
+		return POSTING_NOT_ALLOWED;
 
-	nntp_get_response(tinfo, response);
+	if (strncmp(response, NNTP_PROCEED_WITH_POST, 3) != 0) {
+		/* this shouldn't really happen */
+		ui_nntp_unknown_response(tinfo, response);
+		return POSTING_FAILED;
+	}
 
-	pthread_rwlock_wrlock(tinfo->rwlock);
-	tinfo->bytes_written += (length - i);
-	pthread_rwlock_unlock(tinfo->rwlock);
+	iovcnt = nntp_article_iov(iov, data, subject, NULL, NULL,
+				  buffer, length);
 
-	if (!no_ui_updates)
-		ui_chunk_posted(tinfo, (length - i), i);
+	if (send_article(tinfo, iov, iovcnt, length, no_ui_updates) < 0)
+		return POSTING_FAILED;
+
+	if (nntp_get_response(tinfo, response) <= 0)
+		return POSTING_FAILED;
 
 	if (strncmp(response, NNTP_POSTING_FAILED, 3) == 0) {
 		ui_nntp_posting_failed(tinfo, response);
@@ -169,30 +160,161 @@ int nntp_post(newspost_threadinfo *tinfo, const char *subject, newspost_data *da
 		ui_nntp_unknown_response(tinfo, response);
 		return POSTING_FAILED;
 	}
-	buff_free(buff);
 	return NORMAL;
 }
 
+/* Lays out an article for writev(): the shared headers with the
+ * Subject put in, then the body and the terminator.  An article with a
+ * Message-ID goes straight to the server with TAKETHIS, so it gets
+ * the Date and Path the server would otherwise have added as well.
+ * Returns the number of entries, NNTP_ARTICLE_IOV at most. */
+int nntp_article_iov(struct iovec *iov, newspost_data *data,
+		     const char *subject, const char *msgid, const char *date,
+		     const char *buffer, long length) {
+	int n = 0;
+
+	iov[n].iov_base = data->header->data;
+	iov[n++].iov_len = data->subject_offset;
+	iov[n].iov_base = "Subject: ";
+	iov[n++].iov_len = 9;
+	iov[n].iov_base = (char *) subject;
+	iov[n++].iov_len = strlen(subject);
+	iov[n].iov_base = "\r\n";
+	iov[n++].iov_len = 2;
+	if (msgid != NULL) {
+		iov[n].iov_base = "Message-ID: ";
+		iov[n++].iov_len = 12;
+		iov[n].iov_base = (char *) msgid;
+		iov[n++].iov_len = strlen(msgid);
+		iov[n].iov_base = "\r\nDate: ";
+		iov[n++].iov_len = 8;
+		iov[n].iov_base = (char *) date;
+		iov[n++].iov_len = strlen(date);
+		iov[n].iov_base = "\r\nPath: not-for-mail\r\n";
+		iov[n++].iov_len = 22;
+	}
+	iov[n].iov_base = data->header->data + data->subject_offset;
+	iov[n++].iov_len = data->header->length - data->subject_offset;
+	iov[n].iov_base = (char *) buffer;
+	iov[n++].iov_len = length;
+	iov[n].iov_base = "\r\n.\r\n";
+	iov[n++].iov_len = 5;
+
+	return n;
+}
+
+/* Makes a Message-ID nobody else will use: the time, our pid and a
+ * counter, at the domain of the From address.  msgid holds
+ * NNTP_MSGID_SIZE chars. */
+void nntp_make_msgid(newspost_data *data, char *msgid) {
+	static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+	static unsigned long counter = 0;
+	unsigned long n;
+	const char *domain;
+	int length;
+
+	pthread_mutex_lock(&counter_lock);
+	n = counter++;
+	pthread_mutex_unlock(&counter_lock);
+
+	domain = strrchr(data->from->data, '@');
+	if (domain != NULL) {
+		domain++;
+		length = strcspn(domain, "> \t");
+	}
+	if ((domain == NULL) || (length == 0)) {
+		domain = "newspost.invalid";
+		length = strlen(domain);
+	}
+	if (length > NNTP_MSGID_SIZE - 64)
+		length = NNTP_MSGID_SIZE - 64;
+
+	sprintf(msgid, "<%lx.%lx.%lu@%.*s>", (unsigned long) time(NULL),
+		(unsigned long) getpid(), n, length, domain);
+}
+
+/* Writes the time as an RFC 5322 Date, in UTC so it doesn't depend on
+ * the time zone.  date holds NNTP_DATE_SIZE chars. */
+void nntp_make_date(char *date) {
+	time_t now;
+	struct tm tm;
+
+	now = time(NULL);
+	gmtime_r(&now, &tm);
+	strftime(date, NNTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S +0000", &tm);
+}
+
+/* Takes apart the server's answer to a TAKETHIS: msgid gets the
+ * Message-ID it's about (NNTP_MSGID_SIZE chars).  Returns NORMAL if
+ * the article was taken, ARTICLE_REJECTED if it was turned down, or
+ * POSTING_FAILED if the answer is about no article at all. */
+int nntp_takethis_answer(const char *response, char *msgid) {
+	const char *id;
+	int length;
+
+	msgid[0] = '\0';
+	if ((strncmp(response, NNTP_TRANSFER_OK, 3) != 0) &&
+	    (strncmp(response, NNTP_TRANSFER_REJECTED, 3) != 0))
+		return POSTING_FAILED;
+
+	id = response + 3 + strspn(response + 3, " ");
+	length = strcspn(id, " \r\n");
+	if ((length == 0) || (length >= NNTP_MSGID_SIZE))
+		return POSTING_FAILED;
+	memcpy(msgid, id, length);
+	msgid[length] = '\0';
+
+	if (strncmp(response, NNTP_TRANSFER_OK, 3) == 0)
+		return NORMAL;
+	return ARTICLE_REJECTED;
+}
+
 /* returns number of bytes written */
 int nntp_issue_command(newspost_threadinfo *tinfo, const char *command) {
 	int bytes_written;
-	int sockfd = tinfo->sockfd;
 
-	bytes_written = socket_write(sockfd, command, strlen(command));
+	bytes_written = socket_write(tinfo, command, strlen(command));
 	if (bytes_written > 0) {
-		bytes_written += socket_write(sockfd, "\r\n", 2);
+		bytes_written += socket_write(tinfo, "\r\n", 2);
 		ui_nntp_command_issued(tinfo, command);
 	}
 	return bytes_written;
 }
 
-/* returns number of bytes read */
+/* returns number of bytes read; 0 if the server hung up */
 int nntp_get_response(newspost_threadinfo *tinfo, char *response) {
 	int bytes_read;
 
-	bytes_read = socket_getline(tinfo->sockfd, response);
+	bytes_read = socket_getline(tinfo, response, STRING_BUFSIZE);
 	if (bytes_read > 0)
 		ui_nntp_server_response(tinfo, response);
 
 	return bytes_read;
 }
+
+/**
+*** Private Routines
+**/
+
+/* Writes out iov, of which length bytes are the body, and counts the
+ * body towards the progress.  Returns -1 if the write failed. */
+static long send_article(newspost_threadinfo *tinfo, struct iovec *iov,
+			 int iovcnt, long length, boolean no_ui_updates) {
+	long written;
+
+	if (!no_ui_updates)
+		ui_chunk_posted(tinfo, 0, 0);
+
+	written = socket_writev(tinfo, iov, iovcnt);
+	if (written < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(tinfo->rwlock);
+	tinfo->bytes_written += length;
+	pthread_rwlock_unlock(tinfo->rwlock);
+
+	if (!no_ui_updates)
+		ui_chunk_posted(tinfo, length, length);
+
+	return written;
+}
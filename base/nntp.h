@@ -2,6 +2,7 @@
 #ifndef __NNTP_H__
 #define __NNTP_H__
 
+#include <sys/uio.h>
 #include "newspost.h"
 
 #define NNTP_AUTHENTICATION_SUCCESSFUL "281"
@@ -13,12 +14,29 @@
 #define NNTP_ARTICLE_POSTED_OK "240"
 #define NNTP_POSTING_FAILED "441"
 #define NNTP_DATE "111"
+#define NNTP_STREAMING_OK "203"
+#define NNTP_TRANSFER_OK "239"
+#define NNTP_TRANSFER_REJECTED "439"
+
+#define NNTP_GREETING_POSTING_OK "200"
+#define NNTP_GREETING_NO_POSTING "201"
+
+#define NNTP_MSGID_SIZE 251	/* RFC 3977 allows 250 chars */
+#define NNTP_DATE_SIZE 32	/* "Sun, 17 Oct 2004 12:00:00 +0000" */
+#define NNTP_ARTICLE_IOV 13	/* most entries nntp_article_iov() fills */
 
 boolean nntp_logon(newspost_threadinfo *tinfo, newspost_data *data);
 void nntp_logoff(newspost_threadinfo *tinfo);
 int nntp_issue_command(newspost_threadinfo *tinfo, const char *command);
 int nntp_get_response(newspost_threadinfo *tinfo, char *response);
+void nntp_make_header(newspost_data *data);
 int nntp_post(newspost_threadinfo *tinfo, const char *subject, newspost_data *data,
 	      const char *buffer, long length, boolean no_ui_updates);
+int nntp_article_iov(struct iovec *iov, newspost_data *data,
+		     const char *subject, const char *msgid, const char *date,
+		     const char *buffer, long length);
+void nntp_make_msgid(newspost_data *data, char *msgid);
+void nntp_make_date(char *date);
+int nntp_takethis_answer(const char *response, char *msgid);
 
 #endif /* __NNTP_H__ */
@@ -23,6 +23,17 @@
 #include "utils.h"
 
 #include <pthread.h>
+#include <unistd.h>
+
+/**
+*** Private Declarations
+**/
+
+static void queue_notify(queue *q);
+
+/**
+*** Public Routines
+**/
 
 queue *queue_init(int length) {
 	queue *q;
@@ -40,11 +51,14 @@ queue *queue_init(int length) {
 		q->article_list[i].file_data = NULL;
 		q->article_list[i].partnumber = -1;
 		q->article_list[i].subject = NULL;
+		q->article_list[i].buffer = NULL;
+		q->article_list[i].length = 0;
 	}
 
 	q->empty = TRUE;
 	q->full = FALSE;
 	q->producer_done = FALSE;
+	q->event_fd = -1;
 	q->head = 0;
 	q->tail = 0;
 	q->mut = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
@@ -92,6 +106,9 @@ void queue_item_add(queue *q, post_article_t *in) {
 	item->file_data = in->file_data;
 	item->partnumber = in->partnumber;
 	item->subject = buff_create(item->subject, "%s", in->subject->data);
+	item->buffer = in->buffer;
+	item->spool_fd = in->spool_fd;
+	item->length = in->length;
 
 	/* update queue info */
 	q->tail++;
@@ -101,6 +118,8 @@ void queue_item_add(queue *q, post_article_t *in) {
 		q->full = TRUE;
 	q->empty = FALSE;
 
+	queue_notify(q);
+
 	return;
 }
 
@@ -118,6 +137,9 @@ int queue_item_del(queue *q, post_article_t *out) {
 	out->file_data = item->file_data;
 	out->partnumber = item->partnumber;
 	out->subject = buff_create(out->subject, "%s", item->subject->data);
+	out->buffer = item->buffer;
+	out->spool_fd = item->spool_fd;
+	out->length = item->length;
 
 	/* update queue info */
 	q->head++;
@@ -134,3 +156,120 @@ int queue_item_del(queue *q, post_article_t *out) {
 
 	return n;
 }
+
+/* Tells the consumers no more articles are coming */
+void queue_finish(queue *q) {
+	pthread_mutex_lock(q->mut);
+	q->producer_done = TRUE;
+	queue_notify(q);
+	pthread_mutex_unlock(q->mut);
+
+	pthread_cond_broadcast(q->cond_producer_done);
+	pthread_cond_broadcast(q->cond_not_empty);
+}
+
+/* A fixed number of equally sized buffers, handed out and given back by
+ * the encoder threads and the engine.  They are allocated the first time
+ * they're needed. */
+buffer_pool *buffer_pool_init(int count, long size) {
+	buffer_pool *pool;
+
+	pool = (buffer_pool *) malloc(sizeof(buffer_pool));
+	if (pool == NULL) return (NULL);
+
+	pool->free_list = (char **) malloc(count * sizeof(char *));
+	pool->count = count;
+	pool->nfree = 0;
+	pool->allocated = 0;
+	pool->size = size;
+	pool->slab = NULL;
+	pool->mut = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(pool->mut, NULL);
+	pool->cond_not_empty = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(pool->cond_not_empty, NULL);
+
+	return (pool);
+}
+
+/* only call this once every buffer has been given back */
+void buffer_pool_delete(buffer_pool *pool) {
+	int i;
+
+	if (pool->slab != NULL)
+		free(pool->slab);
+	else
+		for (i = 0; i < pool->nfree; i++)
+			free(pool->free_list[i]);
+	free(pool->free_list);
+
+	pthread_mutex_destroy(pool->mut);
+	free(pool->mut);
+	pthread_cond_destroy(pool->cond_not_empty);
+	free(pool->cond_not_empty);
+	free(pool);
+}
+
+/* Allocates every buffer now, in one piece that can be registered
+ * with the kernel.  Call it before any buffer is handed out.  Returns
+ * the piece, or NULL if it can't be had (the buffers are allocated one
+ * by one later then). */
+char *buffer_pool_preallocate(buffer_pool *pool) {
+	int i;
+
+	if (pool->allocated > 0)
+		return NULL;
+
+	pool->slab = (char *) malloc(pool->count * pool->size);
+	if (pool->slab == NULL)
+		return NULL;
+
+	for (i = 0; i < pool->count; i++)
+		pool->free_list[i] = pool->slab + i * pool->size;
+	pool->nfree = pool->allocated = pool->count;
+
+	return pool->slab;
+}
+
+/* blocks until a buffer is free */
+char *buffer_pool_get(buffer_pool *pool) {
+	char *buffer = NULL;
+
+	pthread_mutex_lock(pool->mut);
+	while ((pool->nfree == 0) && (pool->allocated == pool->count))
+		pthread_cond_wait(pool->cond_not_empty, pool->mut);
+
+	if (pool->nfree > 0)
+		buffer = pool->free_list[--pool->nfree];
+	else {
+		buffer = (char *) malloc(pool->size);
+		if (buffer != NULL)
+			pool->allocated++;
+	}
+	pthread_mutex_unlock(pool->mut);
+
+	return buffer;
+}
+
+void buffer_pool_put(buffer_pool *pool, char *buffer) {
+
+	pthread_mutex_lock(pool->mut);
+	pool->free_list[pool->nfree++] = buffer;
+	pthread_mutex_unlock(pool->mut);
+
+	pthread_cond_signal(pool->cond_not_empty);
+}
+
+/**
+*** Private Routines
+**/
+
+/* call with q->mut held */
+static void queue_notify(queue *q) {
+	unsigned long long one = 1;
+
+	/* the eventfd or pipe is non-blocking; if it's full, the
+	   consumer has a wakeup coming anyway */
+	if (q->event_fd >= 0)
+		if (write(q->event_fd, &one, sizeof(one)) < 0)
+			return;
+}
@@ -11,6 +11,9 @@ typedef struct {
 	file_entry *file_data;
 	int partnumber;
 	Buff *subject;
+	char *buffer;	/* the encoded article, once it's been encoded */
+	int spool_fd;	/* or the spooled one, if buffer is NULL */
+	long length;
 } post_article_t;
 
 typedef struct {
@@ -21,11 +24,29 @@ typedef struct {
 	boolean full, empty, producer_done;
 	pthread_mutex_t *mut;
 	pthread_cond_t *cond_not_full, *cond_not_empty, *cond_producer_done, *cond_empty;
+	int event_fd;	/* if not -1, written to on every change, for a
+			   consumer that poll()s instead of waiting */
 } queue;
 
+typedef struct {
+	char **free_list;
+	int count, nfree, allocated;
+	long size;
+	char *slab;	/* every buffer, if they were allocated at once */
+	pthread_mutex_t *mut;
+	pthread_cond_t *cond_not_empty;
+} buffer_pool;
+
 queue *queue_init(int length);
 void queue_delete(queue *q);
 void queue_item_add(queue *q, post_article_t *in);
 int queue_item_del(queue *q, post_article_t *out);
+void queue_finish(queue *q);
+
+buffer_pool *buffer_pool_init(int count, long size);
+void buffer_pool_delete(buffer_pool *pool);
+char *buffer_pool_preallocate(buffer_pool *pool);
+char *buffer_pool_get(buffer_pool *pool);
+void buffer_pool_put(buffer_pool *pool, char *buffer);
 
 #endif /* __NEWSPOST_QUEUE_H__ */
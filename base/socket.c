@@ -19,81 +19,429 @@
  */
 
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
 
 #include "socket.h"
 #include "../ui/ui.h"
 
+/**
+*** Private Declarations
+**/
+
+static void ignore_sigpipe();
+static struct addrinfo *next_of_family(struct addrinfo *ai, int family);
+
+#ifdef HAVE_OPENSSL
+#define TLS_RECORD_SIZE 16384	/* the most plaintext a record holds */
+
+static SSL_CTX *tls_context = NULL;
+static pthread_mutex_t tls_context_mut = PTHREAD_MUTEX_INITIALIZER;
+
+static SSL *tls_userspace(newspost_threadinfo *tinfo);
+static long tls_send(SSL *ssl, const struct iovec *iov, int iovcnt);
+static int tls_error(SSL *ssl);
+#endif
+
 /**
 *** Public Routines
 **/
 
+/* Looks up the server once, so connections can be opened from it
+ * without resolving again.  Both IPv6 and IPv4 addresses are kept, the
+ * families taking turns from the one getaddrinfo() likes best (RFC
+ * 8305), so a race goes through both early on.  *addrs is malloc()ed.
+ * Returns how many there are, or FAILED_TO_RESOLVE_HOST. */
+int socket_resolve(const char *address, int port, socket_address **addrs) {
+	struct addrinfo hints;
+	struct addrinfo *result, *ai;
+	struct addrinfo *next[2];
+	char service[16];
+	int count = 0;
+	int turn;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%i", port);
+	if (getaddrinfo(address, service, &hints, &result) != 0)
+		return FAILED_TO_RESOLVE_HOST;
+
+	for (ai = result; ai != NULL; ai = ai->ai_next)
+		count++;
+	*addrs = (socket_address *) malloc(count * sizeof(socket_address));
+
+	count = 0;
+	turn = (result->ai_family == AF_INET6) ? 0 : 1;
+	next[0] = next_of_family(result, AF_INET6);
+	next[1] = next_of_family(result, AF_INET);
+	while ((next[0] != NULL) || (next[1] != NULL)) {
+		if (next[turn] == NULL)
+			turn = !turn;
+		ai = next[turn];
+		if (ai->ai_addrlen <= sizeof((*addrs)[count].addr)) {
+			memcpy(&(*addrs)[count].addr, ai->ai_addr,
+			       ai->ai_addrlen);
+			(*addrs)[count].length = ai->ai_addrlen;
+			count++;
+		}
+		next[turn] = next_of_family(ai->ai_next, ai->ai_family);
+		turn = !turn;
+	}
+	freeaddrinfo(result);
+
+	if (count == 0) {
+		free(*addrs);
+		*addrs = NULL;
+		return FAILED_TO_RESOLVE_HOST;
+	}
+	return count;
+}
+
+/* Connects to the server the blocking way, racing its addresses like
+ * the engine does.  Returns the socket, or FAILED_TO_RESOLVE_HOST or
+ * FAILED_TO_CREATE_SOCKET. */
 int socket_create(const char *address, int port) {
-	struct sigaction act, oact; /* used to prevent a crash in
-				       case of a dead socket */
-	/* use these to make the socket to the host */
-	struct sockaddr_in serv_addr;
-	struct in_addr inaddr;
-	int on;
-	struct hostent *hp;
-
-#if (defined(sun) || defined(__sun)) && (defined(__svr4) || \
-defined(__SVR4) || defined(__svr4__))
-	unsigned long tinaddr;
-#endif
+	socket_address *addrs;
+	socket_race race;
+	struct pollfd fds[SOCKET_RACE];
+	int naddrs;
 	int sockfd = -1;
+	int result;
+	int i, n;
 
-	memset ( &serv_addr, 0, sizeof(serv_addr) );
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(port);
+	naddrs = socket_resolve(address, port, &addrs);
+	if (naddrs < 0)
+		return FAILED_TO_RESOLVE_HOST;
 
-	/* Try to convert host name as dotted decimal */
-#if (defined(sun) || defined(__sun)) && (defined(__svr4) || \
-defined(__SVR4) || defined(__svr4__))
-	tinaddr = inet_addr(address);
-	if ( tinaddr != -1 )
-#else
-	if ( inet_aton(address, &inaddr) != 0 ) 
-#endif
-	{
-		memcpy(&serv_addr.sin_addr, &inaddr, sizeof(inaddr));
+	socket_race_start(&race, addrs, naddrs, 0, NULL, 0);
+	result = socket_race_next(&race) ? SOCKET_WANT_WRITE :
+		FAILED_TO_CREATE_SOCKET;
+	while (result == SOCKET_WANT_WRITE) {
+		for (i = 0, n = 0; i < SOCKET_RACE; i++) {
+			if (race.fds[i] < 0)
+				continue;
+			fds[n].fd = race.fds[i];
+			fds[n].events = POLLOUT;
+			n++;
+		}
+		/* nobody answered in time: the next address joins in */
+		if (poll(fds, n, SOCKET_RACE_DELAY) == 0)
+			socket_race_next(&race);
+		result = socket_race_check(&race, &sockfd);
 	}
-	else	/* If that failed, then look up the host name */
-	{
-		if (NULL == (hp = gethostbyname(address)))
-			return FAILED_TO_RESOLVE_HOST;
-		memcpy(&serv_addr.sin_addr, hp->h_addr, hp->h_length);
-	}
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	socket_race_end(&race);
+	free(addrs);
+
+	if (result != NORMAL)
+		return FAILED_TO_CREATE_SOCKET;
+
+	/* it's used the blocking way from here on */
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+	return sockfd;
+}
+
+/* Starts connecting a non-blocking socket to addr, from source if it
+ * isn't NULL; it's connected once it turns writable and
+ * socket_connect_result() says so.  Returns the socket or
+ * FAILED_TO_CREATE_SOCKET. */
+int socket_open(const socket_address *addr, const socket_address *source) {
+	int sockfd;
+	int on = 1;
+
+	sockfd = socket(addr->addr.ss_family, SOCK_STREAM, 0);
 	if (sockfd < 0)
 		return FAILED_TO_CREATE_SOCKET;
 
-	if (connect(sockfd, (struct sockaddr*) &serv_addr,
-	    sizeof(serv_addr)) < 0) {
-		close (sockfd);
+	if ((fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0) ||
+	    (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE,
+			(char *) &on, sizeof(on)) < 0)) {
+		close(sockfd);
 		return FAILED_TO_CREATE_SOCKET;
 	}
 
-	on = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE,
-	    (char*) &on, sizeof(on)) < 0) {
+	ignore_sigpipe();
+
+	if ((source != NULL) &&
+	    (bind(sockfd, (const struct sockaddr *) &source->addr,
+		  source->length) < 0)) {
 		close(sockfd);
 		return FAILED_TO_CREATE_SOCKET;
 	}
 
-	/* If we write() to a dead socket, then let write return
-	 * EPIPE rather than crashing the program. */
+	if ((connect(sockfd, (const struct sockaddr *) &addr->addr,
+		     addr->length) < 0) && (errno != EINPROGRESS)) {
+		close(sockfd);
+		return FAILED_TO_CREATE_SOCKET;
+	}
 
-	act.sa_handler = SIG_IGN;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = 0;
-	sigaction(SIGPIPE, &act, &oact);
+	return sockfd;
+}
+
+/* TRUE if a socket can be bound to source, i.e. it's an address of
+ * this machine */
+boolean socket_bindable(const socket_address *source) {
+	boolean bound;
+	int sockfd;
+
+	sockfd = socket(source->addr.ss_family, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return FALSE;
+	bound = (bind(sockfd, (const struct sockaddr *) &source->addr,
+		      source->length) == 0);
+	close(sockfd);
+	return bound;
+}
+
+/* Gets ready to race connects to addrs, first the one at first (the
+ * one that connected last time, say), then the rest in order.  Each
+ * connects from the first of sources of its address family, if any. */
+void socket_race_start(socket_race *race, const socket_address *addrs,
+		       int naddrs, int first, const socket_address *sources,
+		       int nsources) {
+	int i;
 
-        return sockfd;
+	race->addrs = addrs;
+	race->naddrs = naddrs;
+	race->first = first;
+	race->sources = sources;
+	race->nsources = nsources;
+	race->next = 0;
+	race->won = -1;
+	for (i = 0; i < SOCKET_RACE; i++)
+		race->fds[i] = -1;
+}
+
+/* Starts a connect to the next address that takes one, if there's room
+ * for another attempt.  Returns FALSE if none was started. */
+boolean socket_race_next(socket_race *race) {
+	const socket_address *source;
+	int i, a, s;
+	int sockfd;
+
+	for (i = 0; (i < SOCKET_RACE) && (race->fds[i] >= 0); i++)
+		;
+	if (i == SOCKET_RACE)
+		return FALSE;
+
+	while (race->next < race->naddrs) {
+		a = race->next++;
+		if (a == 0)
+			a = race->first;
+		else if (a <= race->first)
+			a--;
+		/* the first local address of the same family, if any */
+		source = NULL;
+		for (s = 0; (s < race->nsources) && (source == NULL); s++)
+			if (race->sources[s].addr.ss_family ==
+			    race->addrs[a].addr.ss_family)
+				source = &race->sources[s];
+		/* an address family with no route fails right here */
+		sockfd = socket_open(&race->addrs[a], source);
+		if (sockfd >= 0) {
+			race->fds[i] = sockfd;
+			race->tried[i] = a;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Looks at the attempts that are done, without waiting.  A failed one
+ * makes way for the next address right away.  Returns NORMAL with the
+ * winner in *sockfd (the others keep going until socket_race_end()),
+ * SOCKET_WANT_WRITE while they're still at it, or
+ * FAILED_TO_CREATE_SOCKET once every address has failed. */
+int socket_race_check(socket_race *race, int *sockfd) {
+	struct pollfd fds[SOCKET_RACE];
+	int i;
+
+	for (i = 0; i < SOCKET_RACE; i++) {
+		fds[i].fd = race->fds[i];
+		fds[i].events = POLLOUT;
+		fds[i].revents = 0;
+	}
+	if (poll(fds, SOCKET_RACE, 0) < 0)
+		return SOCKET_WANT_WRITE;
+
+	for (i = 0; i < SOCKET_RACE; i++) {
+		if ((fds[i].fd < 0) || (fds[i].revents == 0) ||
+		    (fds[i].fd != race->fds[i]))
+			continue;
+		if (socket_connect_result(fds[i].fd) == 0) {
+			*sockfd = race->fds[i];
+			race->won = race->tried[i];
+			race->fds[i] = -1;
+			return NORMAL;
+		}
+		close(race->fds[i]);
+		race->fds[i] = -1;
+		socket_race_next(race);
+	}
+
+	for (i = 0; i < SOCKET_RACE; i++)
+		if (race->fds[i] >= 0)
+			return SOCKET_WANT_WRITE;
+	return FAILED_TO_CREATE_SOCKET;
+}
+
+/* gives up on the attempts still going */
+void socket_race_end(socket_race *race) {
+	int i;
+
+	for (i = 0; i < SOCKET_RACE; i++) {
+		if (race->fds[i] >= 0)
+			close(race->fds[i]);
+		race->fds[i] = -1;
+	}
+}
+
+/* returns 0 once a socket_open() connect succeeded, or its errno */
+int socket_connect_result(int sockfd) {
+	int error = 0;
+	socklen_t length = sizeof(error);
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+		return errno;
+	return error;
+}
+
+/* Gets TLS going on a connected socket: the handshake is done here,
+ * and OpenSSL hands the keys to the kernel (setsockopt() TCP_ULP "tls")
+ * where it can, so the kernel encrypts what writev() and sendfile()
+ * send.  The server's certificate has to check out for servername.
+ * Returns NORMAL, or TLS_FAILED if newspost was built without it. */
+int socket_tls_start(newspost_threadinfo *tinfo, const char *servername) {
+#ifdef HAVE_OPENSSL
+	SSL *ssl;
+	struct in6_addr addr;
+
+	pthread_mutex_lock(&tls_context_mut);
+	if (tls_context == NULL) {
+		tls_context = SSL_CTX_new(TLS_client_method());
+		if (tls_context != NULL) {
+#ifdef SSL_OP_ENABLE_KTLS
+			SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+			SSL_CTX_set_options(tls_context,
+					    SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+			/* socket_send() may offer a bigger write when it
+			   takes up a half finished one */
+			SSL_CTX_set_mode(tls_context,
+					 SSL_MODE_ENABLE_PARTIAL_WRITE |
+					 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+			SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+			SSL_CTX_set_default_verify_paths(tls_context);
+		}
+	}
+	pthread_mutex_unlock(&tls_context_mut);
+	if (tls_context == NULL) {
+		ui_tls_error(ERR_reason_error_string(ERR_get_error()));
+		return TLS_FAILED;
+	}
+
+	ssl = SSL_new(tls_context);
+	if ((ssl == NULL) || (SSL_set_fd(ssl, tinfo->sockfd) != 1)) {
+		ui_tls_error(ERR_reason_error_string(ERR_get_error()));
+		SSL_free(ssl);
+		return TLS_FAILED;
+	}
+	if ((inet_pton(AF_INET, servername, &addr) == 1) ||
+	    (inet_pton(AF_INET6, servername, &addr) == 1))
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), servername);
+	else {
+		SSL_set_tlsext_host_name(ssl, servername);
+		SSL_set1_host(ssl, servername);
+	}
+	SSL_set_connect_state(ssl);
+
+	tinfo->tls = ssl;
+	return NORMAL;
+#else
+	return TLS_FAILED;
+#endif
+}
+
+/* Carries on with the handshake.  Returns NORMAL once it's done,
+ * SOCKET_WANT_READ or SOCKET_WANT_WRITE if a non-blocking socket has
+ * to get ready for it first, TLS_FAILED if the connection broke, or
+ * TLS_REFUSED if the server's certificate or its TLS won't do, which
+ * trying again won't change. */
+int socket_tls_handshake(newspost_threadinfo *tinfo) {
+#ifdef HAVE_OPENSSL
+	long verify;
+
+	ERR_clear_error();
+	if (SSL_do_handshake(tinfo->tls) == 1)
+		return NORMAL;
+
+	switch (SSL_get_error(tinfo->tls, 0)) {
+	case SSL_ERROR_WANT_READ:
+		return SOCKET_WANT_READ;
+	case SSL_ERROR_WANT_WRITE:
+		return SOCKET_WANT_WRITE;
+	case SSL_ERROR_SYSCALL:
+		ui_socket_error((errno != 0) ? errno : ECONNRESET);
+		break;
+	default:
+		verify = SSL_get_verify_result(tinfo->tls);
+		ui_tls_error((verify != X509_V_OK) ?
+			     X509_verify_cert_error_string(verify) :
+			     ERR_reason_error_string(ERR_peek_error()));
+		return TLS_REFUSED;
+	}
+#endif
+	return TLS_FAILED;
+}
+
+/* TRUE if what's written to the socket goes out as it is: the
+ * connection is plain, or the kernel does its encryption */
+boolean socket_kernel_sends(newspost_threadinfo *tinfo) {
+#ifdef HAVE_OPENSSL
+	return (tls_userspace(tinfo) == NULL);
+#else
+	return TRUE;
+#endif
+}
+
+/* TRUE if there's more from the server that socket_fill() can get
+ * without the socket turning readable again */
+boolean socket_pending(newspost_threadinfo *tinfo) {
+#ifdef HAVE_OPENSSL
+	if (tinfo->tls != NULL)
+		return (SSL_pending(tinfo->tls) > 0);
+#endif
+	return FALSE;
+}
+
+/* says goodbye to the server, if it's still there, and lets go of the
+ * TLS of a connection about to be closed */
+void socket_tls_end(newspost_threadinfo *tinfo) {
+#ifdef HAVE_OPENSSL
+	if (tinfo->tls == NULL)
+		return;
+	ERR_clear_error();
+	SSL_shutdown(tinfo->tls);
+	SSL_free(tinfo->tls);
+	ERR_clear_error();
+#endif
+	tinfo->tls = NULL;
 }
 
 void socket_close(int sockfd) {
@@ -101,40 +449,428 @@ void socket_close(int sockfd) {
 		close(sockfd);
 }
 
-/* returns the number of bytes written */
-long socket_write(int sockfd, const char *buffer, long length) {
+/* Closes the socket, throwing away what it hasn't sent yet: the
+ * kernel lets go of all the memory it was sending from at once. */
+void socket_abort(int sockfd) {
+	struct linger linger;
+
+	if (sockfd < 0)
+		return;
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(sockfd);
+}
+
+/* returns the number of bytes written, or -1 on an error */
+long socket_write(newspost_threadinfo *tinfo, const char *buffer,
+		  long length) {
+	struct iovec iov;
+
+	iov.iov_base = (char *) buffer;
+	iov.iov_len = length;
+	return socket_writev(tinfo, &iov, 1);
+}
+
+/* Writes out all of iov, picking up where a short write left off;
+ * iov is used up in the process.  Returns the number of bytes written,
+ * or -1 on an error. */
+long socket_writev(newspost_threadinfo *tinfo, struct iovec *iov,
+		   int iovcnt) {
 	long retval;
+	long total = 0;
 
-	retval =  write(sockfd, buffer, length);
-	if(retval < 0){
+	while (iovcnt > 0) {
+#ifdef HAVE_OPENSSL
+		if (tls_userspace(tinfo) != NULL) {
+			/* a blocking socket; it only fails for real */
+			retval = tls_send(tinfo->tls, iov, iovcnt);
+			if (retval <= 0)
+				return -1;
+		}
+		else
+#endif
+		retval = writev(tinfo->sockfd, iov, iovcnt);
+		if (retval < 0) {
+			if (errno == EINTR)
+				continue;
+			ui_socket_error(errno);
+			return -1;
+		}
+		total += retval;
+
+		iov = socket_iov_advance(iov, &iovcnt, retval);
+	}
+
+	return total;
+}
+
+/* Writes what a non-blocking socket takes of iov right now.  Returns
+ * the number of bytes written, 0 if it takes nothing, or -1 on an
+ * error. */
+long socket_send(newspost_threadinfo *tinfo, const struct iovec *iov,
+		 int iovcnt) {
+	long retval;
+
+#ifdef HAVE_OPENSSL
+	if (tls_userspace(tinfo) != NULL)
+		return tls_send(tinfo->tls, iov, iovcnt);
+#endif
+
+	do
+		retval = writev(tinfo->sockfd, iov, iovcnt);
+	while ((retval < 0) && (errno == EINTR));
+
+	if (retval < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 0;
 		ui_socket_error(errno);
-		return retval; /* never happens */
 	}
-	else{
-		return retval;
+	return retval;
+}
+
+/* Writes what a non-blocking socket takes of length bytes of fd, from
+ * offset on.  Where there's sendfile() they go straight from the page
+ * cache, encrypted by the kernel if it does the TLS.  Returns what
+ * socket_send() does. */
+long socket_sendfile(newspost_threadinfo *tinfo, int fd, long offset,
+		     long length) {
+	long retval;
+	char buffer[65536];
+	struct iovec iov;
+#ifdef __linux__
+	off_t off = offset;
+
+	if (socket_kernel_sends(tinfo)) {
+		do
+			retval = sendfile(tinfo->sockfd, fd, &off, length);
+		while ((retval < 0) && (errno == EINTR));
+	}
+	else
+#endif
+	{
+		if (length > (long) sizeof(buffer))
+			length = sizeof(buffer);
+		retval = pread(fd, buffer, length, (off_t) offset);
+		if (retval > 0) {
+			iov.iov_base = buffer;
+			iov.iov_len = retval;
+			return socket_send(tinfo, &iov, 1);
+		}
+	}
+
+	if (retval < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 0;
+		ui_socket_error(errno);
 	}
+	else if (retval == 0) {
+		/* the spool file came up short */
+		ui_socket_error(EIO);
+		retval = -1;
+	}
+	return retval;
+}
+
+/* Lets socket_send_zerocopy() send from memory without copying it, on
+ * a socket without TLS.  Returns FALSE where that can't be done. */
+boolean socket_zerocopy(newspost_threadinfo *tinfo) {
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+	int one = 1;
+
+	if (tinfo->tls != NULL)
+		return FALSE;
+	return (setsockopt(tinfo->sockfd, SOL_SOCKET, SO_ZEROCOPY,
+			   &one, sizeof(one)) == 0);
+#else
+	return FALSE;
+#endif
 }
 
-/* returns the number of bytes read */
-long socket_getline(int sockfd, char *buffer) {
+/* Like socket_send(), but with MSG_ZEROCOPY: the kernel sends straight
+ * from iov, so it mustn't change until socket_zerocopy_done() says the
+ * kernel is finished with it.  *sends counts the sends it'll say that
+ * about. */
+long socket_send_zerocopy(newspost_threadinfo *tinfo,
+			  const struct iovec *iov, int iovcnt,
+			  unsigned int *sends) {
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+	struct msghdr msg;
 	long retval;
-	char *pi;
-	long i;
-	long read_count = 0;
 
-	i = 0;
-	pi = buffer;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	do
+		retval = sendmsg(tinfo->sockfd, &msg, MSG_ZEROCOPY);
+	while ((retval < 0) && (errno == EINTR));
+
+	if (retval < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 0;
+		/* too many sends the kernel hasn't let go of yet */
+		if (errno == ENOBUFS)
+			return socket_send(tinfo, iov, iovcnt);
+		ui_socket_error(errno);
+	}
+	else if (retval > 0)
+		(*sends)++;
+	return retval;
+#else
+	return socket_send(tinfo, iov, iovcnt);
+#endif
+}
+
+/* Takes the kernel's word for the MSG_ZEROCOPY sends it's finished
+ * with: *done becomes how many of them, counting from the first on the
+ * socket.  *copied is set if it had to copy them after all.  Returns
+ * FALSE if the socket has an error instead. */
+boolean socket_zerocopy_done(int sockfd, unsigned int *done,
+			     boolean *copied) {
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	char control[128];
+
 	while (TRUE) {
-		retval = read(sockfd, pi, 1);
-		if(retval < 0)
-			ui_socket_error(errno);
-		read_count += retval;
-		pi++;
-		if (buffer[i] == '\n')
-			break;
-		i++;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0)
+			return (errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+				(errno == EINTR);
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (((cmsg->cmsg_level != SOL_IP) ||
+			     (cmsg->cmsg_type != IP_RECVERR)) &&
+			    ((cmsg->cmsg_level != SOL_IPV6) ||
+			     (cmsg->cmsg_type != IPV6_RECVERR)))
+				continue;
+			serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				return FALSE;
+			/* ee_info to ee_data, and they come in order */
+			if ((int) (serr->ee_data + 1 - *done) > 0)
+				*done = serr->ee_data + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied = TRUE;
+		}
+	}
+#else
+	return TRUE;
+#endif
+}
+
+/* Skips the first n bytes of iov, which shrinks to what's left;
+ * returns where it now starts */
+struct iovec *socket_iov_advance(struct iovec *iov, int *iovcnt, long n) {
+	while ((*iovcnt > 0) && (n >= (long) iov->iov_len)) {
+		n -= iov->iov_len;
+		iov++;
+		(*iovcnt)--;
+	}
+	if (*iovcnt > 0) {
+		iov->iov_base = (char *) iov->iov_base + n;
+		iov->iov_len -= n;
 	}
-	*pi = '\0';
+	return iov;
+}
 
-	return read_count;
+/* call for every new connection */
+void socket_buffer_init(socket_buffer *rbuf) {
+	rbuf->start = 0;
+	rbuf->end = 0;
 }
+
+/* Reads one line into buffer, which holds size chars; whatever does
+ * not fit is thrown away.  The server is read SOCKET_BUFSIZE bytes at
+ * a time, and what's left over waits in rbuf for the next call.
+ * Returns the length of the whole line, 0 if the server closed the
+ * connection, or -1 on an error. */
+long socket_getline(newspost_threadinfo *tinfo, char *buffer, long size) {
+	long length;
+	long retval;
+
+	while ((length = socket_takeline(&tinfo->input, buffer, size)) == 0) {
+		retval = socket_fill(tinfo);
+		if ((retval < 0) && (errno == EINTR))
+			continue;
+		if (retval <= 0) {
+			if (retval < 0)
+				ui_socket_error(errno);
+			buffer[0] = '\0';
+			return retval;
+		}
+	}
+
+	return length;
+}
+
+/* Reads whatever the server has sent into tinfo's input.  Returns the
+ * number of bytes read, 0 if the server closed the connection, or -1
+ * with errno set (EAGAIN if a non-blocking socket has nothing yet,
+ * EMSGSIZE if a line won't fit in SOCKET_BUFSIZE). */
+long socket_fill(newspost_threadinfo *tinfo) {
+	socket_buffer *rbuf = &tinfo->input;
+	long retval;
+#ifdef HAVE_OPENSSL
+	size_t got;
+#endif
+
+	if (rbuf->start > 0) {
+		memmove(rbuf->data, rbuf->data + rbuf->start,
+			rbuf->end - rbuf->start);
+		rbuf->end -= rbuf->start;
+		rbuf->start = 0;
+	}
+	if (rbuf->end == SOCKET_BUFSIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+#ifdef HAVE_OPENSSL
+	if (tinfo->tls != NULL) {
+		/* records come in whole, even when the kernel decrypts */
+		ERR_clear_error();
+		if (SSL_read_ex(tinfo->tls, rbuf->data + rbuf->end,
+				SOCKET_BUFSIZE - rbuf->end, &got) == 1)
+			retval = got;
+		else if (tls_error(tinfo->tls) == SSL_ERROR_ZERO_RETURN)
+			retval = 0;
+		else
+			retval = -1;
+	}
+	else
+#endif
+	retval = read(tinfo->sockfd, rbuf->data + rbuf->end,
+		      SOCKET_BUFSIZE - rbuf->end);
+	if (retval > 0)
+		rbuf->end += retval;
+	return retval;
+}
+
+/* Takes the next whole line out of rbuf into buffer, which holds size
+ * chars, without reading.  Returns the line's length, or 0 if there's
+ * no whole line yet. */
+long socket_takeline(socket_buffer *rbuf, char *buffer, long size) {
+	char *line = rbuf->data + rbuf->start;
+	char *newline;
+	long length;
+	long copy;
+
+	newline = memchr(line, '\n', rbuf->end - rbuf->start);
+	if (newline == NULL)
+		return 0;
+
+	length = newline + 1 - line;
+	copy = length;
+	if (copy > size - 1)
+		copy = size - 1;
+	memcpy(buffer, line, copy);
+	buffer[copy] = '\0';
+
+	rbuf->start += length;
+	return length;
+}
+
+/**
+*** Private Routines
+**/
+
+/* the first of ai on that are of family */
+static struct addrinfo *next_of_family(struct addrinfo *ai, int family) {
+	while ((ai != NULL) && (ai->ai_family != family))
+		ai = ai->ai_next;
+	return ai;
+}
+
+/* If we write() to a dead socket, then let write return
+ * EPIPE rather than crashing the program. */
+static void ignore_sigpipe() {
+	struct sigaction act, oact;
+
+	act.sa_handler = SIG_IGN;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	sigaction(SIGPIPE, &act, &oact);
+}
+
+#ifdef HAVE_OPENSSL
+
+/* a connection's SSL, if OpenSSL encrypts what it sends */
+static SSL *tls_userspace(newspost_threadinfo *tinfo) {
+	if ((tinfo->tls == NULL) ||
+	    BIO_get_ktls_send(SSL_get_wbio((SSL *) tinfo->tls)))
+		return NULL;
+	return tinfo->tls;
+}
+
+/* Encrypts and sends what the socket takes of iov.  Small entries are
+ * gathered into one record, rather than a record each.  Returns what
+ * socket_send() does. */
+static long tls_send(SSL *ssl, const struct iovec *iov, int iovcnt) {
+	char gather[TLS_RECORD_SIZE];
+	const char *data = iov[0].iov_base;
+	size_t length = iov[0].iov_len;
+	size_t copy;
+	size_t written;
+	int i;
+
+	if ((iovcnt > 1) && (length < sizeof(gather))) {
+		length = 0;
+		for (i = 0; (i < iovcnt) && (length < sizeof(gather)); i++) {
+			copy = iov[i].iov_len;
+			if (copy > sizeof(gather) - length)
+				copy = sizeof(gather) - length;
+			memcpy(gather + length, iov[i].iov_base, copy);
+			length += copy;
+		}
+		data = gather;
+	}
+
+	ERR_clear_error();
+	if (SSL_write_ex(ssl, data, length, &written) == 1)
+		return written;
+
+	switch (tls_error(ssl)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return 0;
+	case SSL_ERROR_SSL:
+		/* tls_error() said what */
+		return -1;
+	}
+	ui_socket_error(errno);
+	return -1;
+}
+
+/* Sets errno for an SSL call that failed, reporting what the socket
+ * layer can't say, and returns SSL_get_error() for it */
+static int tls_error(SSL *ssl) {
+	int error;
+
+	error = SSL_get_error(ssl, 0);
+	switch (error) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		break;
+	case SSL_ERROR_ZERO_RETURN:
+		/* the server said goodbye */
+		errno = EPIPE;
+		break;
+	case SSL_ERROR_SYSCALL:
+		if (errno == 0)
+			errno = ECONNRESET;
+		break;
+	default:
+		ui_tls_error(ERR_reason_error_string(ERR_peek_error()));
+		errno = EPROTO;
+	}
+	return error;
+}
+
+#endif /* HAVE_OPENSSL */
@@ -2,11 +2,78 @@
 #ifndef __SOCKET_H__
 #define __SOCKET_H__
 
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "newspost.h"
 
+/* what socket_tls_handshake() and socket_race_check() wait for */
+#define SOCKET_WANT_READ 1
+#define SOCKET_WANT_WRITE 2
+
+#define SOCKET_RACE 4		/* connect attempts going at once */
+#define SOCKET_RACE_DELAY 250	/* ms before another one joins in */
+
+#define SOCKET_ZEROCOPY_MIN 16384 /* less is cheaper to copy */
+
+/* one of the server's addresses */
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t length;
+}
+socket_address;
+
+/* connect attempts to the server's addresses, racing each other
+ * (RFC 8305, "Happy Eyeballs") */
+typedef struct {
+	const socket_address *addrs;
+	int naddrs;
+	int first;		/* the address to try first */
+	int next;		/* how many have been tried */
+	int fds[SOCKET_RACE];	/* the attempts going on, or -1 */
+	int tried[SOCKET_RACE];	/* the address each of them is for */
+	int won;		/* the address that connected */
+	const socket_address *sources;	/* local addresses to connect from */
+	int nsources;
+}
+socket_race;
+
+int socket_resolve(const char *address, int port, socket_address **addrs);
 int socket_create(const char *address, int port);
+int socket_open(const socket_address *addr, const socket_address *source);
+boolean socket_bindable(const socket_address *source);
+void socket_race_start(socket_race *race, const socket_address *addrs,
+		       int naddrs, int first, const socket_address *sources,
+		       int nsources);
+boolean socket_race_next(socket_race *race);
+int socket_race_check(socket_race *race, int *sockfd);
+void socket_race_end(socket_race *race);
+int socket_connect_result(int sockfd);
+int socket_tls_start(newspost_threadinfo *tinfo, const char *servername);
+int socket_tls_handshake(newspost_threadinfo *tinfo);
+boolean socket_kernel_sends(newspost_threadinfo *tinfo);
+boolean socket_pending(newspost_threadinfo *tinfo);
+void socket_tls_end(newspost_threadinfo *tinfo);
 void socket_close(int sockfd);
-long socket_getline(int sockfd, char *buffer);
-long socket_write(int sockfd, const char *buffer, long length);
+void socket_abort(int sockfd);
+void socket_buffer_init(socket_buffer *rbuf);
+long socket_getline(newspost_threadinfo *tinfo, char *buffer, long size);
+long socket_fill(newspost_threadinfo *tinfo);
+long socket_takeline(socket_buffer *rbuf, char *buffer, long size);
+long socket_write(newspost_threadinfo *tinfo, const char *buffer,
+		  long length);
+long socket_writev(newspost_threadinfo *tinfo, struct iovec *iov,
+		   int iovcnt);
+long socket_send(newspost_threadinfo *tinfo, const struct iovec *iov,
+		 int iovcnt);
+long socket_sendfile(newspost_threadinfo *tinfo, int fd, long offset,
+		     long length);
+boolean socket_zerocopy(newspost_threadinfo *tinfo);
+long socket_send_zerocopy(newspost_threadinfo *tinfo,
+			  const struct iovec *iov, int iovcnt,
+			  unsigned int *sends);
+boolean socket_zerocopy_done(int sockfd, unsigned int *done,
+			     boolean *copied);
+struct iovec *socket_iov_advance(struct iovec *iov, int *iovcnt, long n);
 
 #endif /* __SOCKET_H__ */
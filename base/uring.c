@@ -0,0 +1,350 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Authors: Pietje Bell <pietjebell@pietjebell.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Just enough of io_uring for the engine to queue its sends: a ring
+ * set up with the raw system calls, one registered buffer (the buffer
+ * pool), and completions signalled on an eventfd the engine already
+ * waits on.  uring_init() returns NULL wherever io_uring can't be
+ * used, and the engine sends with sendmsg() then. */
+
+#include "uring.h"
+
+#if !defined(NO_URING) && defined(__linux__) && defined(__GNUC__) && \
+	defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+
+struct uring_s {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned tail;		/* the next entry we fill in */
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	char *fixed;		/* the registered buffer, if there is one */
+	long fixed_size;
+};
+
+/**
+*** Private Declarations
+**/
+
+static boolean supported(int fd, const int *ops, int nops);
+static struct io_uring_sqe *get_sqe(uring *ring);
+
+/**
+*** Public Routines
+**/
+
+/* Sets up a ring for entries sends at a time; every completion is
+ * signalled on event_fd.  Returns NULL if the kernel can't do it. */
+uring *uring_init(unsigned entries, int event_fd) {
+	static const int ops[] = {
+		IORING_OP_SENDMSG, IORING_OP_SEND, IORING_OP_WRITE_FIXED
+	};
+	struct io_uring_params p;
+	uring *ring;
+	char *sq;
+	char *cq;
+
+	memset(&p, 0, sizeof(p));
+	ring = (uring *) calloc(1, sizeof(uring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if ((ring->sq_ring == MAP_FAILED) || (ring->cq_ring == MAP_FAILED) ||
+	    (ring->sqes == MAP_FAILED)) {
+		uring_free(ring);
+		return NULL;
+	}
+
+	sq = (char *) ring->sq_ring;
+	ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	cq = (char *) ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+
+	if (!supported(ring->fd, ops, sizeof(ops) / sizeof(ops[0])) ||
+	    (syscall(__NR_io_uring_register, ring->fd,
+		     IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)) {
+		uring_free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void uring_free(uring *ring) {
+	if ((ring->sqes != NULL) && (ring->sqes != MAP_FAILED))
+		munmap(ring->sqes, ring->sqes_size);
+	if ((ring->cq_ring != NULL) && (ring->cq_ring != MAP_FAILED) &&
+	    (ring->cq_ring != ring->sq_ring))
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if ((ring->sq_ring != NULL) && (ring->sq_ring != MAP_FAILED))
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+/* Registers base as the ring's fixed buffer, so writes from it skip
+ * mapping the pages in every time.  Returns FALSE if the kernel won't
+ * (e.g. it's over RLIMIT_MEMLOCK); writes from it are plain sends then. */
+boolean uring_register(uring *ring, char *base, long size) {
+	struct iovec iov;
+
+	iov.iov_base = base;
+	iov.iov_len = size;
+	if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		return FALSE;
+
+	ring->fixed = base;
+	ring->fixed_size = size;
+	return TRUE;
+}
+
+/* whether buffer lies in the registered buffer */
+boolean uring_fixed(uring *ring, const char *buffer, long length) {
+	return (ring->fixed != NULL) && (buffer >= ring->fixed) &&
+		(buffer + length <= ring->fixed + ring->fixed_size);
+}
+
+/* Queues a sendmsg(); with link, the next entry waits for this one and
+ * is cancelled if it fails or comes up short.  A send only counts as
+ * short for that with MSG_WAITALL, which also has the kernel carry on
+ * with the rest when the socket has room again.  msg must stay put
+ * until its completion.  Returns FALSE if the ring is full. */
+boolean uring_sendmsg(uring *ring, int fd, struct msghdr *msg,
+		      void *user_data, boolean link) {
+	struct io_uring_sqe *sqe = get_sqe(ring);
+
+	if (sqe == NULL)
+		return FALSE;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | (link ? MSG_WAITALL : 0);
+	sqe->user_data = (uintptr_t) user_data;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+	return TRUE;
+}
+
+/* queues a write of buffer, from the registered buffer if it's in it;
+ * linked the same way as uring_sendmsg() */
+boolean uring_write(uring *ring, int fd, const char *buffer, long length,
+		    void *user_data, boolean link) {
+	struct io_uring_sqe *sqe = get_sqe(ring);
+
+	if (sqe == NULL)
+		return FALSE;
+
+	if (uring_fixed(ring, buffer, length)) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = 0;
+	}
+	else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_NOSIGNAL | (link ? MSG_WAITALL : 0);
+	}
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buffer;
+	sqe->len = length;
+	sqe->user_data = (uintptr_t) user_data;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+	return TRUE;
+}
+
+/* Hands everything queued since the last call to the kernel, in one
+ * system call.  Returns how many went, or -1. */
+int uring_submit(uring *ring) {
+	unsigned queued;
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	queued = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (queued == 0)
+		return 0;
+
+	return syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0);
+}
+
+/* Calls done for every completion there is, with what the send
+ * returned (or -errno).  Returns how many there were. */
+int uring_reap(uring *ring, void (*done)(void *user_data, int res, void *arg),
+	       void *arg) {
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	void *user_data;
+	int res;
+	int n = 0;
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		user_data = (void *) (uintptr_t) cqe->user_data;
+		res = cqe->res;
+
+		/* done may queue more, or reap itself */
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+		done(user_data, res, arg);
+		n++;
+
+		head = *ring->cq_head;
+	}
+
+	return n;
+}
+
+/**
+*** Private Routines
+**/
+
+/* whether the kernel knows every one of ops */
+static boolean supported(int fd, const int *ops, int nops) {
+	struct io_uring_probe *probe;
+	size_t size;
+	boolean ok = TRUE;
+	int i;
+
+	size = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	probe = (struct io_uring_probe *) calloc(1, size);
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		    probe, 256) < 0)
+		ok = FALSE;
+
+	for (i = 0; ok && (i < nops); i++)
+		if ((ops[i] >= probe->ops_len) ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			ok = FALSE;
+
+	free(probe);
+	return ok;
+}
+
+/* the next free entry, cleared; NULL if the kernel hasn't taken
+ * enough of them yet */
+static struct io_uring_sqe *get_sqe(uring *ring) {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+	    *ring->sq_mask) {
+		uring_submit(ring);
+		if (ring->tail -
+		    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+		    *ring->sq_mask)
+			return NULL;
+	}
+
+	index = ring->tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->tail++;
+
+	return sqe;
+}
+
+#else /* HAVE_URING */
+
+uring *uring_init(unsigned entries, int event_fd) {
+	return NULL;
+}
+
+void uring_free(uring *ring) {
+}
+
+boolean uring_register(uring *ring, char *base, long size) {
+	return FALSE;
+}
+
+boolean uring_fixed(uring *ring, const char *buffer, long length) {
+	return FALSE;
+}
+
+boolean uring_sendmsg(uring *ring, int fd, struct msghdr *msg,
+		      void *user_data, boolean link) {
+	return FALSE;
+}
+
+boolean uring_write(uring *ring, int fd, const char *buffer, long length,
+		    void *user_data, boolean link) {
+	return FALSE;
+}
+
+int uring_submit(uring *ring) {
+	return -1;
+}
+
+int uring_reap(uring *ring, void (*done)(void *user_data, int res, void *arg),
+	       void *arg) {
+	return 0;
+}
+
+#endif /* HAVE_URING */
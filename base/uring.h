@@ -0,0 +1,22 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/socket.h>
+#include "newspost.h"
+
+typedef struct uring_s uring;
+
+uring *uring_init(unsigned entries, int event_fd);
+void uring_free(uring *ring);
+boolean uring_register(uring *ring, char *base, long size);
+boolean uring_fixed(uring *ring, const char *buffer, long length);
+boolean uring_sendmsg(uring *ring, int fd, struct msghdr *msg,
+		      void *user_data, boolean link);
+boolean uring_write(uring *ring, int fd, const char *buffer, long length,
+		    void *user_data, boolean link);
+int uring_submit(uring *ring);
+int uring_reap(uring *ring, void (*done)(void *user_data, int res, void *arg),
+	       void *arg);
+
+#endif /* __URING_H__ */
@@ -19,6 +19,8 @@
  */
 
 #include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "newspost.h"
 #include "../ui/errors.h"
@@ -29,9 +31,18 @@ file_entry * file_entry_alloc(){
 	file_entry * fe = malloc(sizeof(file_entry));
 	fe->parts = NULL;
 	fe->filename = NULL;
-	fe->rwlock = NULL;
+	fe->map = NULL;
+	fe->number_enc_parts = 0;
+	fe->parts_to_post = 0;
+	fe->generated = FALSE;
+	fe->rwlock = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t));
+	pthread_rwlock_init(fe->rwlock, NULL);
 	fe->parts_posted = 0;
 	fe->post_started = FALSE;
+	fe->crc = 0;
+	fe->crc_valid = FALSE;
+	fe->part_crcs = NULL;
+	fe->part_crc_valid = NULL;
 	return fe;
 }
 
@@ -41,6 +52,12 @@ file_entry * file_entry_free(file_entry *fe){
 			free(fe->parts);
 		if(fe->filename != NULL)
 			buff_free(fe->filename);
+		if(fe->map != NULL)
+			munmap((void *) fe->map, fe->fileinfo.st_size);
+		if(fe->part_crcs != NULL) {
+			free(fe->part_crcs);
+			free(fe->part_crc_valid);
+		}
 		if(fe->rwlock != NULL) {
 			pthread_rwlock_destroy(fe->rwlock);
 			free(fe->rwlock);
@@ -50,6 +67,34 @@ file_entry * file_entry_free(file_entry *fe){
 	return NULL;
 }
 
+/* Maps the whole file read-only, once, so every thread can encode
+   straight from the page cache.  Returns FALSE if it couldn't be
+   mapped; callers then read the file instead. */
+boolean file_entry_map(file_entry *fe){
+	void *map;
+	int fd;
+
+	if(fe->map != NULL)
+		return TRUE;
+	if(fe->fileinfo.st_size <= 0)
+		return FALSE;
+
+	fd = open(fe->filename->data, O_RDONLY);
+	if(fd < 0)
+		return FALSE;
+
+	map = mmap(NULL, fe->fileinfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return FALSE;
+
+	/* parts are read front to back, so let the kernel read ahead */
+	posix_madvise(map, fe->fileinfo.st_size, POSIX_MADV_SEQUENTIAL);
+
+	fe->map = (const unsigned char *) map;
+	return TRUE;
+}
+
 Buff * buff_getline(Buff *buff, FILE *file){
 	char c = fgetc(file);
 	buff = buff_free(buff);
@@ -33,20 +33,26 @@ SList;
 typedef struct {
 	struct stat fileinfo;
 	Buff *filename;
-	n_uint32 crc;
+	const unsigned char *map;	/* the file's contents, if mapped */
 	boolean *parts;
 	int number_enc_parts;
 	int parts_to_post;
+	boolean generated;		/* an SFV or PAR file made for this run */
 
 	/* Only the values below will change while posting */
 	pthread_rwlock_t *rwlock;
 	boolean post_started;
 	int parts_posted;
+	n_uint32 crc;
+	boolean crc_valid;		/* crc is known for the whole file */
+	n_uint32 *part_crcs;		/* crc of each part, once encoded */
+	boolean *part_crc_valid;
 }
 file_entry;
 
 file_entry * file_entry_alloc();
 file_entry * file_entry_free(file_entry *fe);
+boolean file_entry_map(file_entry *fe);
 
 Buff *buff_getline(Buff *buff, FILE *file);
 Buff *buff_add(Buff *buff, char *data, ... );
@@ -25,8 +25,39 @@
 
 #include <fcntl.h>
 
+#if !defined(NO_SIMD) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define CRC_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define BUFFERSIZE 16384   /* (16k) buffer size for reading from the file */
 
+#define GF2_DIM 32	/* dimension of GF(2) vectors (length of CRC) */
+
+#define SLICES 16	/* bytes handled per step by crc32_slice16() */
+
+/* a crc routine works on the inverted crc */
+typedef n_uint32 (*crc_routine)(const unsigned char *buf, size_t len,
+				n_uint32 crc);
+
+static n_uint32 crc32_slice16(const unsigned char *buf, size_t len,
+			      n_uint32 crc);
+#ifdef CRC_X86_SIMD
+static n_uint32 crc32_pclmul(const unsigned char *buf, size_t len,
+			     n_uint32 crc);
+#endif
+
+static crc_routine crc32_update = crc32_slice16;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* crc_slices[k][n] is the crc of byte n followed by k zero bytes */
+static n_uint32 crc_slices[SLICES][256];
+
+static void crc32_init();
+static n_uint32 gf2_matrix_times(const n_uint32 *mat, n_uint32 vec);
+static void gf2_matrix_square(n_uint32 *square, const n_uint32 *mat);
+
 static const n_uint32 crctable[256] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
 	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
@@ -100,16 +131,66 @@ static const n_uint32 crctable[256] = {
 
 n_uint32 crc32(const char *buf, size_t len, n_uint32 crc)
 {
+	pthread_once(&crc_once, crc32_init);
+
 	crc ^= 0xffffffffU;
 
-	for (; len; len--)
-		crc = (crc >> 8) ^ crctable[(crc ^ *buf++) & 0xff];
+	crc = crc32_update((const unsigned char *) buf, len, crc);
 
 	crc ^= 0xffffffffU;
 
 	return crc;
 }
 
+/* Returns the crc of two blocks put together, given the crc of each
+ * block and the length of the second one.  This is zlib's
+ * crc32_combine(): appending len2 zero bytes to the first block is
+ * a linear operation on its crc, done by repeated squaring of the
+ * operator for a single zero bit. */
+n_uint32 crc32_combine(n_uint32 crc1, n_uint32 crc2, n_int64 len2)
+{
+	int n;
+	n_uint32 row;
+	n_uint32 even[GF2_DIM];	/* even-power-of-two zeros operator */
+	n_uint32 odd[GF2_DIM];	/* odd-power-of-two zeros operator */
+
+	if (len2 <= 0)
+		return crc1;
+
+	/* put operator for one zero bit in odd */
+	odd[0] = 0xedb88320U;
+	row = 1;
+	for (n = 1; n < GF2_DIM; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* put operator for two zero bits in even */
+	gf2_matrix_square(even, odd);
+
+	/* put operator for four zero bits in odd */
+	gf2_matrix_square(odd, even);
+
+	/* apply len2 zeros to crc1 (first square will put the operator
+	 * for one zero byte, eight zero bits, in even) */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
 void calculate_crcs(SList *file_list)
 {
 	char		buf[BUFFERSIZE];
@@ -135,8 +216,10 @@ void calculate_crcs(SList *file_list)
 
 			if (nr < 0)
 				ui_crc_error(fn, errno);
-			else
+			else {
 				data->crc = crc;
+				data->crc_valid = TRUE;
+			}
 
 			close(fd);
 		}
@@ -146,3 +229,280 @@ void calculate_crcs(SList *file_list)
 
 	ui_crc_done();
 }
+
+/* calculates the crc of length bytes of a file, starting at offset */
+boolean calculate_part_crc(const char *filename, n_int64 offset,
+			   long length, n_uint32 *crc)
+{
+	char		buf[BUFFERSIZE];
+	long		nr = 0;
+	int		fd;
+
+	*crc = 0;
+
+	if ((fd = open(filename, O_RDONLY, 0)) < 0) {
+		ui_crc_error(filename, errno);
+		return FALSE;
+	}
+
+	if (lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1) {
+		ui_crc_error(filename, errno);
+		close(fd);
+		return FALSE;
+	}
+
+	while (length > 0) {
+		nr = read(fd, buf, (length < BUFFERSIZE) ? length : BUFFERSIZE);
+		if (nr <= 0)
+			break;
+		*crc = crc32(buf, nr, *crc);
+		length -= nr;
+	}
+
+	if (nr < 0)
+		ui_crc_error(filename, errno);
+	close(fd);
+
+	/* a file that got shorter is as bad as one that can't be read */
+	return ((nr >= 0) && (length == 0)) ? TRUE : FALSE;
+}
+
+/* Makes crc32() use the named routine ("slice16" or "pclmul") instead
+ * of the one picked for this CPU.  Returns FALSE if there's no such
+ * routine or the CPU can't run it.  Only the benchmarks need this. */
+boolean crc32_use_kernel(const char *name)
+{
+	pthread_once(&crc_once, crc32_init);
+
+	if (strcmp(name, "slice16") == 0) {
+		crc32_update = crc32_slice16;
+		return TRUE;
+	}
+#ifdef CRC_X86_SIMD
+	if (strcmp(name, "pclmul") == 0 &&
+	    __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1")) {
+		crc32_update = crc32_pclmul;
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+/**
+*** Private Routines
+**/
+
+#define LOAD32(p) ((n_uint32) (p)[0] | ((n_uint32) (p)[1] << 8) | \
+		   ((n_uint32) (p)[2] << 16) | ((n_uint32) (p)[3] << 24))
+
+/* Slicing-by-16: sixteen table lookups per sixteen bytes, with no
+ * dependency between them except the final xor. */
+static n_uint32 crc32_slice16(const unsigned char *buf, size_t len,
+			      n_uint32 crc)
+{
+	n_uint32 a, b, c, d;
+
+	while (len >= SLICES) {
+		a = LOAD32(buf) ^ crc;
+		b = LOAD32(buf + 4);
+		c = LOAD32(buf + 8);
+		d = LOAD32(buf + 12);
+
+		crc = crc_slices[15][a & 0xff] ^
+			crc_slices[14][(a >> 8) & 0xff] ^
+			crc_slices[13][(a >> 16) & 0xff] ^
+			crc_slices[12][a >> 24] ^
+			crc_slices[11][b & 0xff] ^
+			crc_slices[10][(b >> 8) & 0xff] ^
+			crc_slices[9][(b >> 16) & 0xff] ^
+			crc_slices[8][b >> 24] ^
+			crc_slices[7][c & 0xff] ^
+			crc_slices[6][(c >> 8) & 0xff] ^
+			crc_slices[5][(c >> 16) & 0xff] ^
+			crc_slices[4][c >> 24] ^
+			crc_slices[3][d & 0xff] ^
+			crc_slices[2][(d >> 8) & 0xff] ^
+			crc_slices[1][(d >> 16) & 0xff] ^
+			crc_slices[0][d >> 24];
+
+		buf += SLICES;
+		len -= SLICES;
+	}
+
+	for (; len; len--)
+		crc = (crc >> 8) ^ crctable[(crc ^ *buf++) & 0xff];
+
+	return crc;
+}
+
+#ifdef CRC_X86_SIMD
+
+/* Folding constants for the reflected CRC-32 polynomial, from Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ":
+ * x^(4*128+32) mod P, x^(4*128-32) mod P (fold by four), the same for
+ * 128 (fold by one), x^64 mod P, and P and mu for Barrett reduction. */
+static const n_int64 crc_k1k2[2] __attribute__((aligned(16))) =
+	{ 0x0154442bd4LL, 0x01c6e41596LL };
+static const n_int64 crc_k3k4[2] __attribute__((aligned(16))) =
+	{ 0x01751997d0LL, 0x00ccaa009eLL };
+static const n_int64 crc_k5k0[2] __attribute__((aligned(16))) =
+	{ 0x0163cd6124LL, 0x0000000000LL };
+static const n_int64 crc_poly[2] __attribute__((aligned(16))) =
+	{ 0x01db710641LL, 0x01f7011641LL };
+
+/* Folds 64 bytes at a time with carry-less multiplies, then reduces
+ * to 32 bits.  len must be at least 64 and a multiple of 16. */
+__attribute__((target("sse4.1,pclmul")))
+static n_uint32 crc32_fold(const unsigned char *buf, size_t len,
+			   n_uint32 crc)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *) crc_k1k2);
+
+	buf += 64;
+	len -= 64;
+
+	/* fold four blocks of 16 in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold the four into one */
+	x0 = _mm_load_si128((const __m128i *) crc_k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold any remaining blocks of 16 */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *) buf);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *) crc_k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction down to 32 bits */
+	x0 = _mm_load_si128((const __m128i *) crc_poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static n_uint32 crc32_pclmul(const unsigned char *buf, size_t len,
+			     n_uint32 crc)
+{
+	size_t chunk;
+
+	if (len >= 64) {
+		chunk = len & ~(size_t) 15;
+		crc = crc32_fold(buf, chunk, crc);
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return crc32_slice16(buf, len, crc);
+}
+
+#endif /* CRC_X86_SIMD */
+
+/* builds the slicing tables and picks the fastest crc routine */
+static void crc32_init()
+{
+	int k, n;
+
+	for (n = 0; n < 256; n++)
+		crc_slices[0][n] = crctable[n];
+
+	for (k = 1; k < SLICES; k++)
+		for (n = 0; n < 256; n++)
+			crc_slices[k][n] = (crc_slices[k - 1][n] >> 8) ^
+				crctable[crc_slices[k - 1][n] & 0xff];
+
+#ifdef CRC_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		crc32_update = crc32_pclmul;
+#endif
+}
+
+static n_uint32 gf2_matrix_times(const n_uint32 *mat, n_uint32 vec)
+{
+	n_uint32 sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(n_uint32 *square, const n_uint32 *mat)
+{
+	int n;
+
+	for (n = 0; n < GF2_DIM; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
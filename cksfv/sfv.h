@@ -5,7 +5,11 @@
 #include "../base/newspost.h"
 
 n_uint32 crc32(const char *buf, size_t len, n_uint32 crc);
+n_uint32 crc32_combine(n_uint32 crc1, n_uint32 crc2, n_int64 len2);
+boolean crc32_use_kernel(const char *name);
 void calculate_crcs(SList *file_list);
+boolean calculate_part_crc(const char *filename, n_int64 offset,
+			   long length, n_uint32 *crc);
 void newsfv(SList *file_list, newspost_data *np_data);
 
 #endif /* __SFV_H__ */
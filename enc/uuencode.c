@@ -50,6 +50,7 @@
 
 #include "../base/newspost.h"
 #include "../ui/ui.h"
+#include "uuencode.h"
 
 /* Reworked to GNU style by Ian Lance Taylor, ian@airs.com, August 93.  */
 
@@ -72,61 +73,203 @@ const char trans_ptr[64] =
 /* ENC is the basic 1 character encoding function to make a char printing.  */
 #define ENC(Char) (trans_ptr[(Char)])
 
+#if !defined(NO_SIMD) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define UU_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+*** Private Declarations
+**/
+
+/* An encoding kernel turns lines full lines (UU_BYTES_PER_LINE bytes
+ * each) of in into uuencoded text at out, and returns how many chars
+ * it wrote. */
+typedef long (*uu_kernel)(const unsigned char *in, long lines,
+			  unsigned char *out);
+
+static unsigned char *uu_line(const unsigned char *in, int n,
+			      unsigned char *ch);
+static long uu_scalar(const unsigned char *in, long lines,
+		      unsigned char *out);
+#ifdef UU_X86_SIMD
+static long uu_ssse3(const unsigned char *in, long lines,
+		     unsigned char *out);
+#endif
+
+static uu_kernel uu_encode_lines = uu_scalar;
+static pthread_once_t uu_once = PTHREAD_ONCE_INIT;
+
+static void uu_select_kernel();
+
 /**
 *** Public Routines
 **/
 
-long uu_encode(FILE *infile, char *outbuf, int maxlines)
+/* encodes psize bytes of inbuf; every line but the last holds
+ * UU_BYTES_PER_LINE bytes */
+long uu_encode(const unsigned char *inbuf, char *outbuf, long psize)
 {
-	int counter = 0;
-	int n;
-	char *p, *ch;
-	char inbuf[80];
-	
-	ch = outbuf;
-	while (counter < maxlines) {
-		counter++;
-		n = fread(inbuf, 1, 45, infile);
-		
-		if (n == 0)
-			break;
-		
-		*ch = ENC(n);
-		if (*ch == '.') { 
-			ch++;
-			*ch++ = '.';
-		}
-		else
-			ch++;
-		
-		for (p = inbuf; n > 0; n -= 3, p += 3) {
-			if (n < 3) {
-				p[2] = '\0';
-				if (n < 2)
-					p[1] = '\0';
-			}
-			
-			*ch++ = ENC( (*p >> 2) & 077 );
-			*ch++ = ENC( ((*p << 4) & 060) | ((p[1] >> 4) & 017) );
-			*ch++ = ENC( ((p[1] << 2) & 074) | ((p[2] >> 6) & 03) );
-			*ch++ = ENC( p[2] & 077 );
-		}
-		*ch++ = '\r';
-		*ch++ = '\n';
+	long lines = psize / UU_BYTES_PER_LINE;
+	unsigned char *ch = (unsigned char *) outbuf;
+
+	pthread_once(&uu_once, uu_select_kernel);
+
+	ch += uu_encode_lines(inbuf, lines, ch);
+	inbuf += lines * UU_BYTES_PER_LINE;
+
+	if ((psize % UU_BYTES_PER_LINE) != 0)
+		ch = uu_line(inbuf, psize % UU_BYTES_PER_LINE, ch);
+
+	*ch = '\0';
+
+	return ch - (unsigned char *) outbuf;
+}
+
+/* Makes uu_encode() use the named kernel ("scalar" or "ssse3")
+ * instead of the one picked for this CPU.  Returns FALSE if there's
+ * no such kernel or the CPU can't run it.  Only the benchmarks need
+ * this. */
+boolean uu_use_kernel(const char *name)
+{
+	pthread_once(&uu_once, uu_select_kernel);
+
+	if (strcmp(name, "scalar") == 0) {
+		uu_encode_lines = uu_scalar;
+		return TRUE;
+	}
+#ifdef UU_X86_SIMD
+	if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+		uu_encode_lines = uu_ssse3;
+		return TRUE;
 	}
+#endif
+	return FALSE;
+}
+
+/**
+*** Private Routines
+**/
+
+/* encodes a line of n (at most UU_BYTES_PER_LINE) bytes */
+static unsigned char *uu_line(const unsigned char *in, int n,
+			      unsigned char *ch)
+{
+	unsigned char p[3];
+
+	*ch = ENC(n);
+	if (*ch == '.') { 
+		ch++;
+		*ch++ = '.';
+	}
+	else
+		ch++;
 	
-	if (feof(infile) != 0) {
-		*ch++ = ENC('\0');
+	for (; n > 0; n -= 3, in += 3) {
+		p[0] = in[0];
+		p[1] = (n > 1) ? in[1] : '\0';
+		p[2] = (n > 2) ? in[2] : '\0';
+
+		*ch++ = ENC( (*p >> 2) & 077 );
+		*ch++ = ENC( ((*p << 4) & 060) | ((p[1] >> 4) & 017) );
+		*ch++ = ENC( ((p[1] << 2) & 074) | ((p[2] >> 6) & 03) );
+		*ch++ = ENC( p[2] & 077 );
+	}
+	*ch++ = '\r';
+	*ch++ = '\n';
+
+	return ch;
+}
+
+static long uu_scalar(const unsigned char *in, long lines,
+		      unsigned char *out)
+{
+	unsigned char *ch = out;
+
+	for (; lines > 0; lines--, in += UU_BYTES_PER_LINE)
+		ch = uu_line(in, UU_BYTES_PER_LINE, ch);
+
+	return ch - out;
+}
+
+#ifdef UU_X86_SIMD
+
+/* Expands the 3-byte groups picked out by shuffle into 4 six-bit values
+ * each, in output order, and maps them onto trans_ptr: 0 becomes '`',
+ * everything else has ' ' added. */
+__attribute__((target("ssse3")))
+static inline __m128i uu_expand_ssse3(__m128i in, __m128i shuffle)
+{
+	__m128i t0, t1;
+
+	/* every 32 bit lane holds b1 b0 b2 b1 of its group */
+	in = _mm_shuffle_epi8(in, shuffle);
+
+	/* shift the fields of b0:b1 and b1:b2 into bytes 0 and 1,
+	 * and 2 and 3 */
+	t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+			     _mm_set1_epi32(0x04000040));
+	t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+			     _mm_set1_epi32(0x01000010));
+	in = _mm_or_si128(t0, t1);
+
+	t0 = _mm_and_si128(_mm_cmpeq_epi8(in, _mm_setzero_si128()),
+			   _mm_set1_epi8('`' - ' '));
+	return _mm_add_epi8(_mm_add_epi8(in, _mm_set1_epi8(' ')), t0);
+}
+
+/* A full line is 15 groups: three vectors of four groups loaded from
+ * the start of the line, and the last three groups loaded from its
+ * last 16 bytes, so nothing outside the line is read. */
+__attribute__((target("ssse3")))
+static long uu_ssse3(const unsigned char *in, long lines,
+		     unsigned char *out)
+{
+	const __m128i head = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					   7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i tail = _mm_setr_epi8(8, 7, 9, 8, 11, 10, 12, 11,
+					   14, 13, 15, 14, -1, -1, -1, -1);
+	unsigned char *ch = out;
+	__m128i v;
+	int last;
+
+	for (; lines > 0; lines--, in += UU_BYTES_PER_LINE) {
+		/* ENC(UU_BYTES_PER_LINE) is 'M', never a dot */
+		*ch++ = ENC(UU_BYTES_PER_LINE);
+
+		v = uu_expand_ssse3(_mm_loadu_si128((const __m128i *) in),
+				    head);
+		_mm_storeu_si128((__m128i *) ch, v);
+		v = uu_expand_ssse3(_mm_loadu_si128((const __m128i *)
+						    (in + 12)), head);
+		_mm_storeu_si128((__m128i *) (ch + 16), v);
+		v = uu_expand_ssse3(_mm_loadu_si128((const __m128i *)
+						    (in + 24)), head);
+		_mm_storeu_si128((__m128i *) (ch + 32), v);
+
+		v = uu_expand_ssse3(_mm_loadu_si128((const __m128i *)
+						    (in + 29)), tail);
+		_mm_storel_epi64((__m128i *) (ch + 48), v);
+		last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+		memcpy(ch + 56, &last, 4);
+
+		ch += 60;
 		*ch++ = '\r';
 		*ch++ = '\n';
 	}
-	else if (ferror(infile)) {
-		ui_generic_error(errno);
-		return 0;
-	}
-	
-	*ch = '\0';
-	
-	return ch - outbuf;
+
+	return ch - out;
 }
 
+#endif /* UU_X86_SIMD */
+
+static void uu_select_kernel()
+{
+#ifdef UU_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("ssse3"))
+		uu_encode_lines = uu_ssse3;
+#endif
+}
@@ -2,6 +2,9 @@
 #ifndef __UUENCODE_H__
 #define __UUENCODE_H__
 
-long uu_encode(FILE *infile, char *outbuf, int maxlines);
+#define UU_BYTES_PER_LINE 45
+
+long uu_encode(const unsigned char *inbuf, char *outbuf, long psize);
+boolean uu_use_kernel(const char *name);
 
 #endif /* __UUENCODE_H__ */
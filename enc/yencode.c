@@ -28,70 +28,394 @@
 #include "../ui/ui.h"
 #include "yencode.h"
 
+#if !defined(NO_SIMD) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define YENC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define YENC_BLOCK_SIZE 16384	/* bytes checksummed and encoded at a time */
+
+/**
+*** Private Declarations
+**/
+
+/* An encoding kernel turns len bytes of in into yEnc at out, breaking
+ * lines at line characters.  *linepos carries the position on the
+ * current output line from one call to the next. */
+typedef long (*yenc_kernel)(const unsigned char *in, long len,
+			    unsigned char *out, int *linepos, int line);
+
+/* Every kernel comes in a version for any line length, and versions
+ * with the common lengths built in so the end-of-line checks compare
+ * against constants. */
+#define YENC_FIXED_LENGTHS 3
+
+typedef struct {
+	yenc_kernel any;
+	yenc_kernel fixed[YENC_FIXED_LENGTHS];	/* 128, 256 and 512 */
+} yenc_kernel_set;
+
+#define YENC_KERNEL_SET(name, target, encode)				\
+target static long name##_any(const unsigned char *in, long len,	\
+			      unsigned char *out, int *linepos, int line) \
+{ return encode(in, len, out, linepos, line); }				\
+target static long name##_128(const unsigned char *in, long len,	\
+			      unsigned char *out, int *linepos, int line) \
+{ return encode(in, len, out, linepos, 128); }				\
+target static long name##_256(const unsigned char *in, long len,	\
+			      unsigned char *out, int *linepos, int line) \
+{ return encode(in, len, out, linepos, 256); }				\
+target static long name##_512(const unsigned char *in, long len,	\
+			      unsigned char *out, int *linepos, int line) \
+{ return encode(in, len, out, linepos, 512); }				\
+static const yenc_kernel_set name##_kernels = {				\
+	name##_any, { name##_128, name##_256, name##_512 }		\
+};
+
+static const yenc_kernel_set *yenc_kernels;
+static pthread_once_t yenc_once = PTHREAD_ONCE_INIT;
+
+static void yenc_select_kernel();
+static const yenc_kernel_set *yenc_find_kernel(const char *name);
+
 /**
 *** Public Routines
 **/
 
-long yencode(FILE *infile, char *outbuf, long psize, n_uint32 *crc)
+/* The part is checksummed and encoded a block at a time, so each block
+ * is read from memory only once. */
+long yencode(const unsigned char *inbuf, char *outbuf, long psize,
+	     n_uint32 *crc, int line)
 {
 	long counter;
-	int n, ylinepos;
-	unsigned char *p, *ch, c;
-	unsigned char inbuf[YENC_LINE_LENGTH];
+	long n;
+	int ylinepos;
+	unsigned char *ch;
+	yenc_kernel yenc_encode;
+
+	pthread_once(&yenc_once, yenc_select_kernel);
+
+	switch (line) {
+	case 128:
+		yenc_encode = yenc_kernels->fixed[0];
+		break;
+	case 256:
+		yenc_encode = yenc_kernels->fixed[1];
+		break;
+	case 512:
+		yenc_encode = yenc_kernels->fixed[2];
+		break;
+	default:
+		yenc_encode = yenc_kernels->any;
+	}
 
 	ylinepos = 0;
-	n = 0;
 	counter = 0;
 
 	ch = (unsigned char *) outbuf;
-	p = inbuf;
 
 	while (counter < psize) {
+		n = psize - counter;
+		if (n > YENC_BLOCK_SIZE)
+			n = YENC_BLOCK_SIZE;
 
-		if (n == 0) {
-			n = fread(inbuf, 1, YENC_LINE_LENGTH, infile);
-			p = inbuf;
-			*crc = crc32((char *) inbuf, n, *crc);
-		}
+		*crc = crc32((const char *) inbuf, n, *crc);
+		ch += yenc_encode(inbuf, n, ch, &ylinepos, line);
+
+		inbuf += n;
+		counter += n;
+	}
+
+	*ch++ = '\r';
+	*ch++ = '\n';
+	*ch = '\0';
+
+	return ch - (unsigned char *) outbuf;
+}
+
+/* Makes yencode() use the named kernel ("scalar", "sse2", "ssse3",
+ * "avx2" or "avx512") instead of the one picked for this CPU.  Returns
+ * FALSE if there's no such kernel or the CPU can't run it.  Only the
+ * benchmarks need this. */
+boolean yenc_use_kernel(const char *name)
+{
+	const yenc_kernel_set *kernels;
+
+	pthread_once(&yenc_once, yenc_select_kernel);
+
+	kernels = yenc_find_kernel(name);
+	if (kernels == NULL)
+		return FALSE;
+
+	yenc_kernels = kernels;
+	return TRUE;
+}
+
+/**
+*** Private Routines
+**/
+
+/* encodes a single byte, exactly as the yEnc spec wants it:
+ * NUL, TAB, LF, CR and '=' are always escaped, '.' only at
+ * the start of a line */
+static inline unsigned char *yenc_byte(unsigned char *ch, unsigned char c,
+				       int *ylinepos, const int line)
+{
+	if (*ylinepos >= line) {
+		*ch++ = '\r';
+		*ch++ = '\n';
+		*ylinepos = 0;
+	}
+
+	c += 42;
+
+	switch (c) {
+	case '.':
+		if (*ylinepos > 0)
+			break;
+		/* fall through */
+	case '\0':
+	case 9:
+	case '\n':
+	case '\r':
+	case '=':
+		*ch++ = '=';
+		c += 64;
+		(*ylinepos)++;
+	}
+
+	*ch++ = c;
+	(*ylinepos)++;
+
+	return ch;
+}
+
+static inline __attribute__((always_inline))
+long yenc_scalar(const unsigned char *in, long len, unsigned char *out,
+		 int *linepos, const int line)
+{
+	unsigned char *ch = out;
+	const unsigned char *end = in + len;
+
+	while (in < end)
+		ch = yenc_byte(ch, *in++, linepos, line);
+
+	return ch - out;
+}
+
+YENC_KERNEL_SET(yenc_scalar, , yenc_scalar)
+
+#ifdef YENC_X86_SIMD
 
-		if (ylinepos >= YENC_LINE_LENGTH) {
+/* A block routine adds 42 to WIDTH bytes of in, stores them unescaped
+ * at out (the output buffer has room to spare) and returns a bit mask
+ * of the bytes that need escaping. */
+typedef unsigned long long (*yenc_block)(const unsigned char *in,
+					 unsigned char *out);
+
+/* Shared driver for the vector kernels.  Whole blocks are stored as
+ * long as they hold no escapes and fit on the current line; the first
+ * byte that needs attention is handed to yenc_byte(), so the output is
+ * identical to that of yenc_scalar(). */
+static inline __attribute__((always_inline))
+long yenc_vector(const unsigned char *in, long len, unsigned char *out,
+		 int *linepos, const int line, const int width,
+		 yenc_block block)
+{
+	unsigned char *ch = out;
+	int ylinepos = *linepos;
+	unsigned long long mask;
+	long i = 0;
+	int room, n;
+
+	while (len - i >= width) {
+		if (ylinepos >= line) {
 			*ch++ = '\r';
 			*ch++ = '\n';
 			ylinepos = 0;
 		}
 
-		c = *p + 42;
-
-		switch (c) {
-		case '.':
-			if (ylinepos > 0)
-				break;
-		case '\0':
-		case 9:
-		case '\n':
-		case '\r':
-		case '=':
-			*ch++ = '=';
-			c += 64;
-			ylinepos++;
+		mask = block(in + i, ch);
+
+		/* a dot is only special in the first column */
+		if ((ylinepos == 0) && (ch[0] == '.'))
+			mask |= 1;
+
+		/* densely escaped data goes faster a byte at a time than
+		   by storing the block again after every escape */
+		if (__builtin_popcountll(mask) > width / 8) {
+			for (n = 0; n < width; n++)
+				ch = yenc_byte(ch, in[i++], &ylinepos, line);
+			continue;
 		}
 
-		*ch++ = c;
+		/* stop at the end of the line */
+		room = line - ylinepos;
+		if (room < width)
+			mask |= ~0ULL << room;
 
-		counter++;
-		ylinepos++;
-		n--;
-		p++;
-	}
+		if (mask == 0) {
+			ch += width;
+			i += width;
+			ylinepos += width;
+			continue;
+		}
 
-	*ch++ = '\r';
-	*ch++ = '\n';
-	*ch = '\0';
+		n = __builtin_ctzll(mask);
+		ch += n;
+		i += n;
+		ylinepos += n;
 
-	if (ferror(infile)) {
-		ui_generic_error(errno);
-		return 0;
+		if (n < room)
+			ch = yenc_byte(ch, in[i++], &ylinepos, line);
 	}
 
-	return ch - (unsigned char *) outbuf;
+	while (i < len)
+		ch = yenc_byte(ch, in[i++], &ylinepos, line);
+
+	*linepos = ylinepos;
+	return ch - out;
+}
+
+__attribute__((target("sse2")))
+static inline unsigned long long yenc_block_sse2(const unsigned char *in,
+						 unsigned char *out)
+{
+	__m128i v, m;
+
+	v = _mm_add_epi8(_mm_loadu_si128((const __m128i *) in),
+			 _mm_set1_epi8(42));
+	_mm_storeu_si128((__m128i *) out, v);
+
+	m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+			 _mm_cmpeq_epi8(v, _mm_set1_epi8(9)));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+
+	return (unsigned int) _mm_movemask_epi8(m);
+}
+
+/* The escape set is classified with two nibble lookups: bit 0 marks
+ * 0x00, 0x09, 0x0a and 0x0d, bit 1 marks 0x3d. */
+#define YENC_LO_NIBBLES	1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 3, 0, 0
+#define YENC_HI_NIBBLES	1, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+__attribute__((target("ssse3")))
+static inline unsigned long long yenc_block_ssse3(const unsigned char *in,
+						  unsigned char *out)
+{
+	const __m128i lo_table = _mm_setr_epi8(YENC_LO_NIBBLES);
+	const __m128i hi_table = _mm_setr_epi8(YENC_HI_NIBBLES);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i v, lo, hi;
+
+	v = _mm_add_epi8(_mm_loadu_si128((const __m128i *) in),
+			 _mm_set1_epi8(42));
+	_mm_storeu_si128((__m128i *) out, v);
+
+	lo = _mm_shuffle_epi8(lo_table, _mm_and_si128(v, nibble));
+	hi = _mm_shuffle_epi8(hi_table,
+			      _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+	lo = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+
+	return (~(unsigned int) _mm_movemask_epi8(lo)) & 0xffff;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned long long yenc_block_avx2(const unsigned char *in,
+						 unsigned char *out)
+{
+	const __m256i lo_table = _mm256_setr_epi8(YENC_LO_NIBBLES,
+						  YENC_LO_NIBBLES);
+	const __m256i hi_table = _mm256_setr_epi8(YENC_HI_NIBBLES,
+						  YENC_HI_NIBBLES);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i v, lo, hi;
+
+	v = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *) in),
+			    _mm256_set1_epi8(42));
+	_mm256_storeu_si256((__m256i *) out, v);
+
+	lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+	hi = _mm256_shuffle_epi8(hi_table,
+				 _mm256_and_si256(_mm256_srli_epi16(v, 4),
+						  nibble));
+	lo = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi),
+			       _mm256_setzero_si256());
+
+	return (~(unsigned int) _mm256_movemask_epi8(lo)) & 0xffffffffULL;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline unsigned long long yenc_block_avx512(const unsigned char *in,
+						   unsigned char *out)
+{
+	__m512i v;
+
+	v = _mm512_add_epi8(_mm512_loadu_si512((const void *) in),
+			    _mm512_set1_epi8(42));
+	_mm512_storeu_si512((void *) out, v);
+
+	return _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512()) |
+		_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(9)) |
+		_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n')) |
+		_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\r')) |
+		_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('='));
+}
+
+#define YENC_VECTOR(name, width, block)				\
+static inline __attribute__((always_inline))				\
+long name(const unsigned char *in, long len, unsigned char *out,	\
+	  int *linepos, const int line)					\
+{ return yenc_vector(in, len, out, linepos, line, width, block); }
+
+YENC_VECTOR(yenc_sse2, 16, yenc_block_sse2)
+YENC_VECTOR(yenc_ssse3, 16, yenc_block_ssse3)
+YENC_VECTOR(yenc_avx2, 32, yenc_block_avx2)
+YENC_VECTOR(yenc_avx512, 64, yenc_block_avx512)
+
+YENC_KERNEL_SET(yenc_sse2, __attribute__((target("sse2"))), yenc_sse2)
+YENC_KERNEL_SET(yenc_ssse3, __attribute__((target("ssse3"))), yenc_ssse3)
+YENC_KERNEL_SET(yenc_avx2, __attribute__((target("avx2"))), yenc_avx2)
+YENC_KERNEL_SET(yenc_avx512, __attribute__((target("avx512f,avx512bw"))),
+		yenc_avx512)
+
+#endif /* YENC_X86_SIMD */
+
+/* picks the widest kernel the CPU supports */
+static void yenc_select_kernel()
+{
+	yenc_kernels = &yenc_scalar_kernels;
+
+#ifdef YENC_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512bw"))
+		yenc_kernels = &yenc_avx512_kernels;
+	else if (__builtin_cpu_supports("avx2"))
+		yenc_kernels = &yenc_avx2_kernels;
+	else if (__builtin_cpu_supports("ssse3"))
+		yenc_kernels = &yenc_ssse3_kernels;
+	else if (__builtin_cpu_supports("sse2"))
+		yenc_kernels = &yenc_sse2_kernels;
+#endif
+}
+
+static const yenc_kernel_set *yenc_find_kernel(const char *name)
+{
+	if (strcmp(name, "scalar") == 0)
+		return &yenc_scalar_kernels;
+#ifdef YENC_X86_SIMD
+	if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512bw"))
+		return &yenc_avx512_kernels;
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+		return &yenc_avx2_kernels;
+	if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3"))
+		return &yenc_ssse3_kernels;
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+		return &yenc_sse2_kernels;
+#endif
+	return NULL;
 }
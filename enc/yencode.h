@@ -2,8 +2,12 @@
 #ifndef __YENCODE_H__
 #define __YENCODE_H__
 
-#define YENC_LINE_LENGTH 128
+#define YENC_LINE_LENGTH 128	/* the default */
+#define YENC_MIN_LINE_LENGTH 32
+#define YENC_MAX_LINE_LENGTH 997	/* escapes may add one; NNTP allows 998 */
 
-long yencode(FILE *infile, char *outbuf, long psize, n_uint32 *crc);
+long yencode(const unsigned char *inbuf, char *outbuf, long psize,
+	     n_uint32 *crc, int line);
+boolean yenc_use_kernel(const char *name);
 
 #endif /* __YENCODE_H__ */
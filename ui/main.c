@@ -22,6 +22,8 @@
 
 #include <signal.h>
 
+#include "../base/encode.h"
+#include "../enc/yencode.h"
 #include "errors.h"
 #include "options.h"
 #include "ui.h"
@@ -30,7 +32,10 @@ boolean writedefaults = FALSE;
 
 const char *EDITOR = NULL;
 
+static newspost_data *data_ptr = NULL;
+
 static void signal_handler();
+static void bandwidth_handler();
 
 int main(int argc, char **argv) {
 	newspost_data main_data;
@@ -43,6 +48,7 @@ int main(int argc, char **argv) {
 	boolean posting_anything = FALSE;
 	Buff *command = NULL;
 	file_entry *file_data = NULL;
+	newspost_server *server;
 
 	retval = NORMAL;
 
@@ -56,10 +62,27 @@ int main(int argc, char **argv) {
 	main_data.organization = NULL;
 	main_data.address = NULL;
 	main_data.port = 119;
+	main_data.tls = FALSE;
 	main_data.user = NULL;
 	main_data.password = NULL;
 	main_data.threads = 1;
+	main_data.servers = NULL;
+	main_data.sources = NULL;
+	main_data.stream = 0;
+	main_data.bandwidth = 0;
+	main_data.burst = 0;
+	main_data.bandwidth_changed = FALSE;
+	main_data.connect_timeout = SOCKET_CONNECT_TIMEOUT_SECONDS;
+	main_data.send_timeout = SOCKET_SEND_TIMEOUT_SECONDS;
+	main_data.response_timeout = NNTP_RESPONSE_TIMEOUT_SECONDS;
+	main_data.zerocopy = FALSE;
 	main_data.lines = 5000;
+	main_data.linelength = YENC_LINE_LENGTH;
+	main_data.article_size = 0;
+	main_data.part_size = 0;
+	main_data.page_align = FALSE;
+	main_data.spool = FALSE;
+	main_data.spooldir = NULL;
 	main_data.uuenc = FALSE;
 	main_data.sfv = NULL;
 	main_data.par = NULL;
@@ -74,11 +97,14 @@ int main(int argc, char **argv) {
 	main_data.name = NULL;
 	main_data.extra_headers = NULL;
 	main_data.text = FALSE;
+	main_data.header = NULL;
+	main_data.subject_offset = 0;
 
 	/* get all options */
 	parse_environment(&main_data);
 	parse_defaults(&main_data);
 	optind = parse_options(argc, argv, &main_data);
+	set_part_size(&main_data);
 
 	file_list = (SList *) parse_input_files(argc, argv, optind,
 						&main_data);
@@ -92,6 +118,17 @@ int main(int argc, char **argv) {
 
 	check_options(&main_data);
 
+	/* NNTPS has a port of its own */
+	if ((main_data.tls == TRUE) && (main_data.port == 119))
+		main_data.port = 563;
+	for (pi = main_data.servers; pi != NULL; pi = slist_next(pi)) {
+		server = (newspost_server *) pi->data;
+		if (server->port == 0)
+			server->port = (main_data.tls == TRUE) ? 563 : 119;
+		if (server->threads == 0)
+			server->threads = main_data.threads;
+	}
+
 	if ((main_data.text == FALSE) && (file_list == NULL)) {
 		fprintf(stderr, "\nNo files to post!\n");
 		exit(EXIT_NO_FILES);
@@ -128,6 +165,20 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	/* the spool is kept from one run to the next, so it isn't in
+	   the directory made for this one */
+	if ((main_data.spool == TRUE) && (main_data.text == FALSE)) {
+		main_data.spooldir = buff_create(main_data.spooldir,
+			"%s/newspost-spool", (main_data.tmpdir != NULL) ?
+			main_data.tmpdir->data : P_tmpdir);
+		if ((mkdir(main_data.spooldir->data, S_IRWXU) == -1) &&
+		    (errno != EEXIST)) {
+			ui_tmpdir_create_failed(main_data.spooldir->data, errno);
+			exit(EXIT_FAILED_TO_CREATE_TMPFILES);
+		}
+		prune_spool(&main_data);
+	}
+
 	/* create the directory for storing temporary files */
 	/* only create it if we need it */
 	if ((main_data.sfv != NULL)
@@ -195,6 +246,13 @@ int main(int argc, char **argv) {
 			}
 		}
 	}
+	/* kill -USR1 changes the bandwidth limit while it posts */
+	data_ptr = &main_data;
+	act.sa_handler = bandwidth_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &act, NULL);
+
 	/* post */
 	if (NORMAL == retval)
 		retval = newspost(&main_data, file_list);
@@ -244,11 +302,15 @@ int main(int argc, char **argv) {
 	buff_free(main_data.par);
 	buff_free(main_data.reference);
 	buff_free(main_data.tmpdir);
+	buff_free(main_data.spooldir);
 	buff_free(main_data.followupto);
 	buff_free(main_data.replyto);
 	buff_free(main_data.name);
+	buff_free(main_data.header);
 	if (main_data.extra_headers != NULL)
 		slist_free(main_data.extra_headers);
+	free_servers(&main_data);
+	free_sources(&main_data);
 
 	switch (retval) {
 
@@ -279,11 +341,21 @@ int main(int argc, char **argv) {
 			"\nFailed to logon to the server\n");
 		exit(EXIT_LOGON_FAILED);
 
+	case TLS_FAILED:
+		fprintf(stderr,
+			"\nFailed to start TLS with the server\n");
+		exit(EXIT_FAILED_TO_CREATE_SOCKET);
+
 	case POSTING_NOT_ALLOWED:
 		fprintf(stderr,
 			"\nPosting is not allowed\n");
 		exit(EXIT_POSTING_NOT_ALLOWED);
 
+	case POSTING_FAILED:
+		fprintf(stderr,
+			"\nSome parts could not be posted\n");
+		exit(EXIT_POSTING_FAILED);
+
 	default:
 		fprintf(stderr,
 			"\nInternal error.  "
@@ -308,3 +380,8 @@ static void signal_handler() {
 	fprintf(stderr, "\n");
 	exit(EXIT_SIGNAL);
 }
+
+/* the engine reads the limit again when it sees this */
+static void bandwidth_handler() {
+	data_ptr->bandwidth_changed = TRUE;
+}
@@ -21,6 +21,7 @@
 
 #include <getopt.h>
 #include "../base/encode.h"
+#include "../enc/yencode.h"
 #include "options.h"
 #include "ui.h"
 
@@ -33,10 +34,22 @@
 #define organization_option 'o'
 #define address_option 'i'
 #define port_option 'z'
+#define tls_option 'e'
 #define user_option 'u'
 #define password_option 'p'
 #define threads_option 'N'
+#define server_option 'H'
+#define bind_option 'I'
+#define stream_option 'y'
+#define bandwidth_option 'b'
+#define timeout_option 'O'
+#define zerocopy_option 'Z'
 #define lines_option 'l'
+#define linelength_option 'L'
+#define articlesize_option 'S'
+#define partsize_option 'P'
+#define pagealign_option 'g'
+#define spool_option 'E'
 #define uuenc_option 'U'
 #define sfv_option 'c'
 #define par_option 'a'
@@ -65,10 +78,22 @@
 #define organization_long_option "organization"
 #define address_long_option "host"
 #define port_long_option "port"
+#define tls_long_option "tls"
 #define user_long_option "user"
 #define password_long_option "password"
 #define threads_long_option "threads"
+#define server_long_option "server"
+#define bind_long_option "bind"
+#define stream_long_option "stream"
+#define bandwidth_long_option "bandwidth"
+#define timeout_long_option "timeout"
+#define zerocopy_long_option "zerocopy"
 #define lines_long_option "lines"
+#define linelength_long_option "line-length"
+#define articlesize_long_option "article-size"
+#define partsize_long_option "part-size"
+#define pagealign_long_option "page-align"
+#define spool_long_option "spool"
 #define uuenc_long_option "uuenc"
 #define sfv_long_option "sfv"
 #define par_long_option "par"
@@ -99,10 +124,22 @@ static const char short_options[] = {
 	organization_option, ':',
 	address_option, ':',
 	port_option, ':',
+	tls_option,
 	user_option, ':',
 	password_option, ':',
 	threads_option, ':',
+	server_option, ':',
+	bind_option, ':',
+	stream_option, ':',
+	bandwidth_option, ':',
+	timeout_option, ':',
+	zerocopy_option,
 	lines_option, ':',
+	linelength_option, ':',
+	articlesize_option, ':',
+	partsize_option, ':',
+	pagealign_option,
+	spool_option,
 	uuenc_option,
 	sfv_option, ':',
 	par_option, ':',
@@ -136,10 +173,22 @@ static struct option long_options[] =
 	{ organization_long_option, required_argument, NULL, organization_option },
 	{ address_long_option,      required_argument, NULL, address_option },
 	{ port_long_option,         required_argument, NULL, port_option },
+	{ tls_long_option,                no_argument, NULL, tls_option },
 	{ user_long_option,         required_argument, NULL, user_option },
 	{ password_long_option,     required_argument, NULL, password_option },
 	{ threads_long_option,      required_argument, NULL, threads_option },
+	{ server_long_option,       required_argument, NULL, server_option },
+	{ bind_long_option,         required_argument, NULL, bind_option },
+	{ stream_long_option,       required_argument, NULL, stream_option },
+	{ bandwidth_long_option,    required_argument, NULL, bandwidth_option },
+	{ timeout_long_option,      required_argument, NULL, timeout_option },
+	{ zerocopy_long_option,           no_argument, NULL, zerocopy_option },
 	{ lines_long_option,        required_argument, NULL, lines_option },
+	{ linelength_long_option,   required_argument, NULL, linelength_option },
+	{ articlesize_long_option,  required_argument, NULL, articlesize_option },
+	{ partsize_long_option,     required_argument, NULL, partsize_option },
+	{ pagealign_long_option,          no_argument, NULL, pagealign_option },
+	{ spool_long_option,              no_argument, NULL, spool_option },
 	{ uuenc_long_option,              no_argument, NULL, uuenc_option },
 	{ sfv_long_option,          required_argument, NULL, sfv_option },
 	{ par_long_option,          required_argument, NULL, par_option },
@@ -170,10 +219,22 @@ enum {
 	organization,
 	address,
 	port,
+	tls,
 	user,
 	password,
 	threads,
+	server,
+	bind,
+	stream,
+	bandwidth,
+	timeout,
+	zerocopy,
 	lines,
+	linelength,
+	articlesize,
+	partsize,
+	pagealign,
+	spool,
 	uuenc,
 	filenumber,
 	noarchive,
@@ -194,10 +255,22 @@ static const char *rc_keyword[number_of_defaults] = {
 	"organization",
 	"address",
 	"port",
+	"tls",
 	"user",
 	"password",
 	"threads",
+	"server",
+	"bind",
+	"stream",
+	"bandwidth",
+	"timeout",
+	"zerocopy",
 	"lines",
+	"linelength",
+	"articlesize",
+	"partsize",
+	"pagealign",
+	"spool",
 	"uuenc",
 	"filenumber",
 	"noarchive",
@@ -217,10 +290,22 @@ static const char *rc_comment[number_of_defaults] = {
 	"your organization",
 	"address of news server",
 	"port of news server",
+	"0 for a plain connection, 1 for TLS (usually on port 563)",
 	"username on news server",
 	"password on news server",
 	"number of threads to use",
+	"another server, as [user[:password]@]host[:port][/threads]",
+	"a local address to connect from, as address[/weight]",
+	"articles in flight per connection with TAKETHIS, 0 to use POST",
+	"bytes per second to post at in all, then :burst if you like, 0 for no limit",
+	"seconds to connect:to get a send anywhere:to answer, 0 to wait forever",
+	"0 copies articles into the kernel, 1 sends them with MSG_ZEROCOPY",
 	"lines per message",
+	"characters per yEnc line",
+	"largest article size instead of lines, 0 for none",
+	"bytes of the file per message instead of lines, 0 for none",
+	"0 doesn't round message sizes to pages, 1 does",
+	"0 encodes every time, 1 keeps encoded messages to post again",
 	"0 to yencode, 1 to uuencode",
 	"0 doesn't include filenumber in subject line, 1 does",
 	"0 doesn't include X-No-Archive header, 1 does",
@@ -236,6 +321,13 @@ static void version_info();
 static boolean parse_file_parts(newspost_data *data,
 			file_entry *this_file_entry, const char *arg, int i);
 static void parse_delay_option(const char *option);
+static newspost_server *parse_server(const char *spec);
+static void print_server(FILE *file, newspost_server *more);
+static newspost_source *parse_source(const char *spec);
+static void print_source(FILE *file, newspost_source *source);
+static long parse_size(const char *option);
+static void parse_bandwidth(const char *option, newspost_data *data);
+static void parse_timeout(const char *option, newspost_data *data);
 
 
 /**
@@ -314,10 +406,6 @@ SList *parse_input_files(int argc, char **argv, int optind,
 					this_file_entry->parts = NULL;
 
 				if (postany == TRUE) {
-					/* initialize the read/write lock for this file entry */
-					this_file_entry->rwlock = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t));
-					pthread_rwlock_init(this_file_entry->rwlock, NULL);
-
 					/* add it to the list */
 					file_list = slist_append(file_list,
 							this_file_entry);
@@ -399,6 +487,8 @@ void parse_defaults(newspost_data *data) {
 	char *setting;
 	FILE *file;
 	Buff *header = NULL;
+	newspost_server *more;
+	newspost_source *source;
 	int i, linenum = 0;
 	Buff *filename = NULL;
 	Buff *line = NULL;
@@ -443,6 +533,9 @@ void parse_defaults(newspost_data *data) {
 				    case port:
 					data->port = atoi(setting);
 					break;
+				    case tls:
+					data->tls = atoi(setting);
+					break;
 				    case user:
 					data->user = buff_create(data->user, "%s", setting);
 					break;
@@ -452,9 +545,60 @@ void parse_defaults(newspost_data *data) {
 				    case threads:
 					data->threads = atoi(setting);
 					break;
+				    case server:
+					more = parse_server(setting);
+					if (more == NULL) {
+						fprintf(stderr,
+						    "\nWARNING: invalid server in"
+						    " %s: line %i",
+						    filename->data, linenum);
+						break;
+					}
+					data->servers =
+					   slist_append(data->servers, more);
+					break;
+				    case bind:
+					source = parse_source(setting);
+					if (source == NULL) {
+						fprintf(stderr,
+						    "\nWARNING: invalid bind"
+						    " address in %s: line %i",
+						    filename->data, linenum);
+						break;
+					}
+					data->sources =
+					   slist_append(data->sources, source);
+					break;
+				    case stream:
+					data->stream = atoi(setting);
+					break;
+				    case bandwidth:
+					parse_bandwidth(setting, data);
+					break;
+				    case timeout:
+					parse_timeout(setting, data);
+					break;
+				    case zerocopy:
+					data->zerocopy = atoi(setting);
+					break;
 				    case lines:
 					data->lines = atoi(setting);
 					break;
+				    case linelength:
+					data->linelength = atoi(setting);
+					break;
+				    case articlesize:
+					data->article_size = parse_size(setting);
+					break;
+				    case partsize:
+					data->part_size = parse_size(setting);
+					break;
+				    case pagealign:
+					data->page_align = atoi(setting);
+					break;
+				    case spool:
+					data->spool = atoi(setting);
+					break;
 				    case uuenc:
 					data->uuenc = atoi(setting);
 					break;
@@ -575,9 +719,11 @@ boolean set_defaults(newspost_data *data) {
 				(data->organization != NULL) ? data->organization->data : "",
 				rc_comment[address],
 				rc_keyword[address], (data->address != NULL) ? data->address->data : "");
-			fprintf(file, "# %s\n%s=%i\n\n",
+			fprintf(file, "# %s\n%s=%i\n\n# %s\n%s=%i\n\n",
 				rc_comment[port],
-				rc_keyword[port], data->port);
+				rc_keyword[port], data->port,
+				rc_comment[tls],
+				rc_keyword[tls], data->tls);
 			fprintf(file, "# %s\n%s=%s\n\n# %s\n%s=%s\n\n# %s\n%s=%i\n\n",
 				rc_comment[user],
 				rc_keyword[user], (data->user != NULL) ? data->user->data : "",
@@ -585,16 +731,55 @@ boolean set_defaults(newspost_data *data) {
 				rc_keyword[password], (data->password != NULL) ? data->password->data : "",
 				rc_comment[threads],
 				rc_keyword[threads], data->threads);
+			fprintf(file, "# %s\n", rc_comment[server]);
+			for (tmplist = data->servers; tmplist != NULL;
+			     tmplist = slist_next(tmplist))
+				print_server(file, tmplist->data);
+			fprintf(file, "\n# %s\n", rc_comment[bind]);
+			for (tmplist = data->sources; tmplist != NULL;
+			     tmplist = slist_next(tmplist))
+				print_source(file, tmplist->data);
+			fprintf(file, "\n# %s\n%s=%i\n\n",
+				rc_comment[stream],
+				rc_keyword[stream], data->stream);
+			fprintf(file, "# %s\n%s=%li",
+				rc_comment[bandwidth],
+				rc_keyword[bandwidth], data->bandwidth);
+			if (data->burst > 0)
+				fprintf(file, ":%li", data->burst);
+			fprintf(file, "\n\n");
+			fprintf(file, "# %s\n%s=%i:%i:%i\n\n",
+				rc_comment[timeout], rc_keyword[timeout],
+				data->connect_timeout, data->send_timeout,
+				data->response_timeout);
+			fprintf(file, "# %s\n%s=%i\n\n",
+				rc_comment[zerocopy], rc_keyword[zerocopy],
+				data->zerocopy);
 			fprintf(file, "# %s\n%s=%i\n\n# %s\n%s=%i\n\n"
-				"# %s\n%s=%i\n\n# %s\n%s=%i\n\n",
+				"# %s\n%s=%i\n\n# %s\n%s=%i\n\n"
+				"# %s\n%s=%i\n\n",
 				rc_comment[lines],
 				rc_keyword[lines], data->lines,
+				rc_comment[linelength],
+				rc_keyword[linelength], data->linelength,
 				rc_comment[uuenc],
 				rc_keyword[uuenc], data->uuenc,
 				rc_comment[filenumber],
 				rc_keyword[filenumber], data->filenumber,
 				rc_comment[noarchive],
 				rc_keyword[noarchive], data->noarchive);
+			/* part_size is worked out from article_size */
+			fprintf(file, "# %s\n%s=%li\n\n# %s\n%s=%li\n\n"
+				"# %s\n%s=%i\n\n# %s\n%s=%i\n\n",
+				rc_comment[articlesize],
+				rc_keyword[articlesize], data->article_size,
+				rc_comment[partsize],
+				rc_keyword[partsize],
+				(data->article_size > 0) ? 0 : data->part_size,
+				rc_comment[pagealign],
+				rc_keyword[pagealign], data->page_align,
+				rc_comment[spool],
+				rc_keyword[spool], data->spool);
 			fprintf(file, "# %s\n%s=%s\n\n# %s\n%s=%s\n\n#"
 				" %s\n%s=%s\n\n",
 				rc_comment[followupto],
@@ -645,6 +830,8 @@ int parse_options(int argc, char **argv, newspost_data *data) {
 	int flag, i, long_options_index;
 	SList *listptr;
 	Buff *header = NULL;
+	newspost_server *more;
+	newspost_source *source;
 	boolean isflag = FALSE;
 
 	opterr = 0;
@@ -685,6 +872,10 @@ int parse_options(int argc, char **argv, newspost_data *data) {
 				data->port = atoi(optarg);
 				break;
 
+			case tls_option:
+				data->tls = TRUE;
+				break;
+
 			case user_option:
 				data->user = buff_create(data->user, "%s", optarg);
 				break;
@@ -697,10 +888,77 @@ int parse_options(int argc, char **argv, newspost_data *data) {
 				data->threads = atoi(optarg);
 				break;
 
+			case server_option:
+				more = parse_server(optarg);
+				if (more == NULL) {
+					fprintf(stderr,
+						"\nThe -%c option takes"
+						" [user[:password]@]host"
+						"[:port][/threads]\n",
+						server_option);
+					exit(EXIT_MISSING_ARGUMENT);
+				}
+				data->servers = slist_append(data->servers,
+							     more);
+				break;
+
+			case bind_option:
+				source = parse_source(optarg);
+				if (source == NULL) {
+					fprintf(stderr,
+						"\nThe -%c option takes"
+						" address[/weight]\n",
+						bind_option);
+					exit(EXIT_MISSING_ARGUMENT);
+				}
+				data->sources = slist_append(data->sources,
+							     source);
+				break;
+
+			case stream_option:
+				data->stream = atoi(optarg);
+				break;
+
+			case bandwidth_option:
+				parse_bandwidth(optarg, data);
+				break;
+
+			case timeout_option:
+				parse_timeout(optarg, data);
+				break;
+
+			case zerocopy_option:
+				data->zerocopy = TRUE;
+				break;
+
 			case lines_option:
+				data->article_size = 0;
+				data->part_size = 0;
 				data->lines = atoi(optarg);
 				break;
 
+			case linelength_option:
+				data->linelength = atoi(optarg);
+				break;
+
+			case articlesize_option:
+				data->part_size = 0;
+				data->article_size = parse_size(optarg);
+				break;
+
+			case partsize_option:
+				data->article_size = 0;
+				data->part_size = parse_size(optarg);
+				break;
+
+			case pagealign_option:
+				data->page_align = TRUE;
+				break;
+
+			case spool_option:
+				data->spool = TRUE;
+				break;
+
 			case uuenc_option:
 				data->uuenc = TRUE;
 				break;
@@ -790,6 +1048,33 @@ int parse_options(int argc, char **argv, newspost_data *data) {
 					data->password = buff_free(data->password);
 					break;
 
+				case stream_option:
+					data->stream = 0;
+					break;
+
+				case server_option:
+					free_servers(data);
+					break;
+
+				case bind_option:
+					free_sources(data);
+					break;
+
+				case bandwidth_option:
+					data->bandwidth = 0;
+					data->burst = 0;
+					break;
+
+				case timeout_option:
+					data->connect_timeout = 0;
+					data->send_timeout = 0;
+					data->response_timeout = 0;
+					break;
+
+				case zerocopy_option:
+					data->zerocopy = FALSE;
+					break;
+
 				case name_option:
 					data->name = buff_free(data->name);
 					break;
@@ -829,6 +1114,24 @@ int parse_options(int argc, char **argv, newspost_data *data) {
 					data->filenumber = FALSE;
 					break;
 
+				case articlesize_option:
+				case partsize_option:
+					data->article_size = 0;
+					data->part_size = 0;
+					break;
+
+				case pagealign_option:
+					data->page_align = FALSE;
+					break;
+
+				case spool_option:
+					data->spool = FALSE;
+					break;
+
+				case tls_option:
+					data->tls = FALSE;
+					break;
+
 				default:
 					fprintf(stderr,
 						"\nUnknown argument to"
@@ -918,6 +1221,32 @@ void check_options(newspost_data *data) {
 			" should be positive.\n");
 		goterror = TRUE;
 	}
+#ifndef HAVE_OPENSSL
+	if (data->tls == TRUE) {
+		fprintf(stderr,
+			"\nThis newspost was built without TLS;"
+			" build it with \"make tls\".\n");
+		goterror = TRUE;
+	}
+#endif
+	if (data->stream < 0) {
+		fprintf(stderr,
+			"\nThe number of articles to stream"
+			" can't be negative.\n");
+		goterror = TRUE;
+	}
+	if ((data->bandwidth < 0) || (data->burst < 0)) {
+		fprintf(stderr,
+			"\nThe bandwidth and burst should be a number"
+			" of bytes, maybe with k or M after it.\n");
+		goterror = TRUE;
+	}
+	if ((data->connect_timeout < 0) || (data->send_timeout < 0) ||
+	    (data->response_timeout < 0)) {
+		fprintf(stderr,
+			"\nThe timeouts can't be negative.\n");
+		goterror = TRUE;
+	}
 #ifndef ALLOW_NO_SUBJECT
 	if (data->subject == NULL) {
 		fprintf(stderr,
@@ -958,10 +1287,103 @@ void check_options(newspost_data *data) {
 				" 5000 to 10000 lines");
 		}
 	}
+	if ((data->article_size < 0) || (data->part_size < 0)) {
+		fprintf(stderr,
+			"\nThe article and part sizes should be a number"
+			" of bytes, maybe with k or M after it.\n");
+		goterror = TRUE;
+	}
+	else if ((data->article_size > 0) &&
+		 (data->article_size < get_min_article_size(data))) {
+		fprintf(stderr,
+			"\nArticles of %li bytes have no room left after"
+			" the headers;\nthe smallest article size is %li.\n",
+			data->article_size, get_min_article_size(data));
+		goterror = TRUE;
+	}
+	if ((data->linelength < YENC_MIN_LINE_LENGTH) ||
+	    (data->linelength > YENC_MAX_LINE_LENGTH)) {
+		fprintf(stderr,
+			"\nyEnc lines should be %i to %i characters long.\n",
+			YENC_MIN_LINE_LENGTH, YENC_MAX_LINE_LENGTH);
+		goterror = TRUE;
+	}
 	if (goterror == TRUE)
 		exit(EXIT_BAD_HEADER_LINE);
 }
 
+/* Reads bandwidth= from .newspostrc again, for kill -USR1 while
+ * posting; without one there's no limit anymore. */
+void reread_bandwidth(newspost_data *data) {
+	const char *envopt;
+	char *setting;
+	FILE *file;
+	Buff *filename = NULL;
+	Buff *line = NULL;
+
+	envopt = getenv("HOME");
+	if (envopt == NULL)
+		return;
+	filename = buff_create(filename, "%s/.newspostrc", envopt);
+	file = fopen(filename->data, "r");
+	buff_free(filename);
+	if (file == NULL)
+		return;
+
+	data->bandwidth = 0;
+	data->burst = 0;
+	while (!feof(file)) {
+		line = buff_getline(line, file);
+		if (line == NULL)
+			continue;
+		setting = strchr(line->data, '=');
+		if (setting == NULL)
+			continue;
+		*setting++ = '\0';
+		if (strcmp(line->data, rc_keyword[bandwidth]) == 0)
+			parse_bandwidth(setting, data);
+	}
+	fclose(file);
+	buff_free(line);
+
+	if ((data->bandwidth < 0) || (data->burst < 0)) {
+		data->bandwidth = 0;
+		data->burst = 0;
+	}
+}
+
+/* forgets the servers given with -H */
+void free_servers(newspost_data *data) {
+	newspost_server *more;
+	SList *listptr;
+
+	for (listptr = data->servers; listptr != NULL;
+	     listptr = slist_next(listptr)) {
+		more = (newspost_server *) listptr->data;
+		buff_free(more->address);
+		buff_free(more->user);
+		buff_free(more->password);
+		free(more);
+	}
+	slist_free(data->servers);
+	data->servers = NULL;
+}
+
+/* forgets the addresses given with -I */
+void free_sources(newspost_data *data) {
+	newspost_source *source;
+	SList *listptr;
+
+	for (listptr = data->sources; listptr != NULL;
+	     listptr = slist_next(listptr)) {
+		source = (newspost_source *) listptr->data;
+		buff_free(source->address);
+		free(source);
+	}
+	slist_free(data->sources);
+	data->sources = NULL;
+}
+
 void print_help() {
 	version_info();
 	printf("\n\nUsage: newspost [OPTIONS [ARGUMENTS]]"
@@ -969,9 +1391,16 @@ void print_help() {
 	printf("\nOptions:");
 	printf("\n  --%-15s  -%c   <string> - hostname or IP of the news server", address_long_option, address_option);
 	printf("\n  --%-15s  -%c   <int>    - port number on the news server", port_long_option, port_option);
+	printf("\n  --%-15s  -%c            - connect with TLS (port 563 unless -%c)", tls_long_option, tls_option, port_option);
 	printf("\n  --%-15s  -%c   <string> - username on the news server", user_long_option, user_option);
 	printf("\n  --%-15s  -%c   <string> - password on the news server", password_long_option, password_option);
 	printf("\n  --%-15s  -%c   <int>    - amount of threads to use for posting", threads_long_option, threads_option);
+	printf("\n  --%-15s  -%c   <string> - post to this server as well", server_long_option, server_option);
+	printf("\n  --%-15s  -%c   <string> - connect from this local address, [/weight]", bind_long_option, bind_option);
+	printf("\n  --%-15s  -%c   <int>    - articles in flight per thread with TAKETHIS", stream_long_option, stream_option);
+	printf("\n  --%-15s  -%c   <size>   - bytes per second to post at, [:burst]", bandwidth_long_option, bandwidth_option);
+	printf("\n  --%-15s  -%c   <int>    - seconds to connect, [:send[:answer]]", timeout_long_option, timeout_option);
+	printf("\n  --%-15s  -%c            - send articles without copying them (Linux)", zerocopy_long_option, zerocopy_option);
 	printf("\n  --%-15s  -%c   <string> - your e-mail address", from_long_option, from_option);
 	printf("\n  --%-15s  -%c   <string> - your full name", name_long_option, name_option);
 	printf("\n  --%-15s  -%c   <string> - your organization", organization_long_option, organization_option);
@@ -989,6 +1418,11 @@ void print_help() {
 	printf("\n  --%-15s  -%c   <int>    - number of PAR volumes to create", parnum_long_option, parnum_option);
 	printf("\n  --%-15s  -%c   <int>    - number of files per PAR volume", filesperpar_long_option, filesperpar_option);
 	printf("\n  --%-15s  -%c   <int>    - number of lines per message", lines_long_option, lines_option);
+	printf("\n  --%-15s  -%c   <int>    - characters per yEnc line (default %i)", linelength_long_option, linelength_option, YENC_LINE_LENGTH);
+	printf("\n  --%-15s  -%c   <size>   - largest article size instead of lines", articlesize_long_option, articlesize_option);
+	printf("\n  --%-15s  -%c   <size>   - bytes of the file per article instead of lines", partsize_long_option, partsize_option);
+	printf("\n  --%-15s  -%c            - round those sizes to whole memory pages", pagealign_long_option, pagealign_option);
+	printf("\n  --%-15s  -%c            - keep encoded messages in tmpdir to post again", spool_long_option, spool_option);
 	printf("\n  --%-15s  -%c            - post one file as plain text", text_long_option, text_option);
 	printf("\n  --%-15s  -%c   <int>    - time to wait before posting", delay_long_option, delay_option);
 	printf("\n  --%-15s  -%c   <string> - use this directory for storing temporary files", tmpdir_long_option, tmpdir_option);
@@ -1190,6 +1624,200 @@ static void parse_delay_option(const char *option) {
 		post_delay = 3;
 }
 
+/* a number of bytes, optionally followed by k or m */
+static long parse_size(const char *option) {
+	const char *pi = option;
+	long size;
+
+	size = atol(option);
+	while ((*pi >= '0') && (*pi <= '9'))
+		pi++;
+	if (pi == option)
+		return -1;
+
+	switch (*pi) {
+
+	case 'k':
+	case 'K':
+		size *= 1024;
+		pi++;
+		break;
+
+	case 'm':
+	case 'M':
+		size *= 1024 * 1024;
+		pi++;
+	}
+
+	/* anything else after the number is a mistake, not a zero */
+	return (*pi == '\0') ? size : -1;
+}
+
+/* Reads [user[:password]@]host[:port][/threads], with an IPv6 host in
+ * brackets if it has a port.  Returns NULL if that's not what it is. */
+static newspost_server *parse_server(const char *spec) {
+	newspost_server *more;
+	Buff *copy = NULL;
+	char *host, *pi;
+	boolean bad = FALSE;
+
+	copy = buff_create(copy, "%s", spec);
+	more = (newspost_server *) calloc(1, sizeof(newspost_server));
+	host = copy->data;
+
+	/* the password may have an @ in it, the host can't */
+	pi = strrchr(host, '@');
+	if (pi != NULL) {
+		*pi = '\0';
+		host = pi + 1;
+		pi = strchr(copy->data, ':');
+		if (pi != NULL)
+			*pi++ = '\0';
+		more->user = buff_create(more->user, "%s", copy->data);
+		more->password = buff_create(more->password, "%s",
+					     (pi != NULL) ? pi : "");
+	}
+
+	pi = strrchr(host, '/');
+	if (pi != NULL) {
+		*pi++ = '\0';
+		more->threads = atoi(pi);
+		if (more->threads <= 0)
+			bad = TRUE;
+	}
+
+	pi = NULL;
+	if (host[0] == '[') {
+		host++;
+		pi = strchr(host, ']');
+		if (pi == NULL)
+			bad = TRUE;
+		else {
+			*pi++ = '\0';
+			if (*pi == '\0')
+				pi = NULL;
+			else if (*pi != ':')
+				bad = TRUE;
+		}
+	}
+	else {
+		/* more than one colon is an IPv6 address without a port */
+		pi = strchr(host, ':');
+		if ((pi != NULL) && (strchr(pi + 1, ':') != NULL))
+			pi = NULL;
+	}
+	if (pi != NULL) {
+		*pi++ = '\0';
+		more->port = atoi(pi);
+		if (more->port <= 0)
+			bad = TRUE;
+	}
+
+	if (host[0] == '\0')
+		bad = TRUE;
+	more->address = buff_create(more->address, "%s", host);
+	buff_free(copy);
+
+	if (bad == TRUE) {
+		buff_free(more->address);
+		buff_free(more->user);
+		buff_free(more->password);
+		free(more);
+		return NULL;
+	}
+	return more;
+}
+
+/* writes a server the way parse_server() reads it */
+static void print_server(FILE *file, newspost_server *more) {
+	fprintf(file, "%s=", rc_keyword[server]);
+	if (more->user != NULL)
+		fprintf(file, "%s:%s@", more->user->data,
+			more->password->data);
+	fprintf(file, (strchr(more->address->data, ':') != NULL) ?
+		"[%s]" : "%s", more->address->data);
+	if (more->port > 0)
+		fprintf(file, ":%i", more->port);
+	if (more->threads > 0)
+		fprintf(file, "/%i", more->threads);
+	fprintf(file, "\n");
+}
+
+/* address[/weight]; the address may be in brackets like a server's */
+static newspost_source *parse_source(const char *spec) {
+	newspost_source *source;
+	Buff *copy = NULL;
+	char *address, *pi;
+	boolean bad = FALSE;
+
+	copy = buff_create(copy, "%s", spec);
+	source = (newspost_source *) calloc(1, sizeof(newspost_source));
+	address = copy->data;
+
+	source->weight = 1;
+	pi = strrchr(address, '/');
+	if (pi != NULL) {
+		*pi++ = '\0';
+		source->weight = atoi(pi);
+		if (source->weight <= 0)
+			bad = TRUE;
+	}
+
+	if (address[0] == '[') {
+		address++;
+		pi = strchr(address, ']');
+		if ((pi == NULL) || (pi[1] != '\0'))
+			bad = TRUE;
+		else
+			*pi = '\0';
+	}
+
+	if ((address[0] == '\0') || (bad == TRUE)) {
+		buff_free(copy);
+		free(source);
+		return NULL;
+	}
+	source->address = buff_create(source->address, "%s", address);
+	buff_free(copy);
+	return source;
+}
+
+/* writes an address the way parse_source() reads it */
+static void print_source(FILE *file, newspost_source *source) {
+	fprintf(file, "%s=%s", rc_keyword[bind], source->address->data);
+	if (source->weight != 1)
+		fprintf(file, "/%i", source->weight);
+	fprintf(file, "\n");
+}
+
+/* a rate the way parse_size() reads it, maybe with :burst after it */
+static void parse_bandwidth(const char *option, newspost_data *data) {
+	Buff *rate = NULL;
+	char *burst;
+
+	rate = buff_create(rate, "%s", option);
+	burst = strchr(rate->data, ':');
+	if (burst != NULL)
+		*burst++ = '\0';
+	data->bandwidth = parse_size(rate->data);
+	data->burst = (burst != NULL) ? parse_size(burst) : 0;
+	buff_free(rate);
+}
+
+/* connect[:send[:response]] in seconds; the ones left out stay as
+ * they were */
+static void parse_timeout(const char *option, newspost_data *data) {
+	data->connect_timeout = atoi(option);
+	option = strchr(option, ':');
+	if (option == NULL)
+		return;
+	data->send_timeout = atoi(++option);
+	option = strchr(option, ':');
+	if (option == NULL)
+		return;
+	data->response_timeout = atoi(++option);
+}
+
 static void version_info() {
 	printf("\n" NEWSPOSTNAME " version " VERSION
 		"\nCopyright (C) 2001 - 2010 Jim Faulkner"
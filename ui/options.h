@@ -27,6 +27,11 @@ int parse_options(int argc, char **argv, newspost_data *data);
 
 void check_options(newspost_data *data);
 
+void reread_bandwidth(newspost_data *data);
+
+void free_servers(newspost_data *data);
+void free_sources(newspost_data *data);
+
 void print_help();
 
 #endif /* __OPTIONS_H__ */
@@ -26,6 +26,7 @@
 #include "ui.h"
 #include "errors.h"
 #include "../base/encode.h"
+#include "../enc/uuencode.h"
 
 /**
 *** Private Declarations
@@ -219,9 +220,13 @@ void ui_post_start(newspost_data *data, SList *file_list, SList *parfiles) {
 			total_bytes += par_bytes;
 		}
 		
-		printf("\n%s %s total and posting to %s\n\n",
+		printf("\n%s %s total and posting to %s",
 		       (data->uuenc == FALSE) ? "Yencoding" : "UUencoding",
 		       byte_print(total_bytes), data->address->data);
+		i = slist_length(data->servers);
+		if (i > 0)
+			printf(" and %i other server%s", i, plural(i));
+		printf("\n\n");
 	}
 	else {
 		fileinfo = file_list->data;
@@ -256,15 +261,29 @@ void ui_socket_connect_start(newspost_threadinfo *tinfo, const char *servername)
 void ui_socket_connect_failed(newspost_threadinfo *tinfo, int retval) {
 	if (verbosity == TRUE) {
 		if (retval == FAILED_TO_RESOLVE_HOST)
-			printf("(Thread %d) Connecting failed: \"Failed to resolve host\", retrying in 120 seconds...\n", tinfo->thread_id);
+			printf("(Thread %d) Connecting failed: \"Failed to resolve host\", retrying...\n", tinfo->thread_id);
 		else if (retval == FAILED_TO_CREATE_SOCKET)
-			printf("(Thread %d) Connecting failed: \"Failed to create socket\", retrying in 120 seconds...\n", tinfo->thread_id);
+			printf("(Thread %d) Connecting failed: \"Failed to create socket\", retrying...\n", tinfo->thread_id);
+		else if (retval == TLS_FAILED)
+			printf("(Thread %d) Connecting failed: \"TLS handshake failed\", retrying...\n", tinfo->thread_id);
 		else
-			printf("(Thread %d) Connecting failed: \"Unknown error\", retrying in 120 seconds...\n", tinfo->thread_id);
+			printf("(Thread %d) Connecting failed: \"Unknown error\", retrying...\n", tinfo->thread_id);
 		fflush(stdout);
 	}
 }
 
+void ui_socket_bind_failed(const char *address) {
+	fprintf(stderr,
+		"\nWARNING: %s is not a local address,"
+		" not connecting from it", address);
+}
+
+void ui_socket_stalled(newspost_threadinfo *tinfo, int seconds) {
+	fprintf(stderr,
+		"\nWARNING: (Thread %d) The connection got nowhere for %d seconds,"
+		" dropping it\n", tinfo->thread_id, seconds);
+}
+
 void ui_socket_connect_done(newspost_threadinfo *tinfo) {
 	if (verbosity == TRUE) {
 		printf("(Thread %d) Connecting done.\n", tinfo->thread_id);
@@ -272,6 +291,15 @@ void ui_socket_connect_done(newspost_threadinfo *tinfo) {
 	}
 }
 
+void ui_tls_started(newspost_threadinfo *tinfo, boolean kernel) {
+	if (verbosity == TRUE) {
+		printf("(Thread %d) TLS started, encrypting %s.\n",
+		       tinfo->thread_id,
+		       kernel ? "in the kernel" : "with OpenSSL");
+		fflush(stdout);
+	}
+}
+
 void ui_nntp_logon_start(newspost_threadinfo *tinfo, const char *servername) {
 	if (verbosity == TRUE) {
 		printf("(Thread %d) Logging on to %s...\n", tinfo->thread_id, servername);
@@ -316,12 +344,11 @@ void ui_nntp_unknown_response(newspost_threadinfo *tinfo, const char *response)
 		"(Thread %d) WARNING: unexpected server response: %s\n", tinfo->thread_id, response);
 }
 
-void ui_posting_file_start(newspost_data *data, file_entry *filedata) {
+void ui_posting_file_start(newspost_data *data, file_entry *filedata,
+			   long bytes_in_first_part) {
 	Buff *tmpbuff = NULL;
-	char *data_buffer = (char *) malloc(get_buffer_size_per_encoded_part(data));
 
 	int number_of_parts = filedata->number_enc_parts;
-	int bytes_in_first_part = get_encoded_part(data, filedata, 1, data_buffer);
 
 	printf("Posting file: %s - %s (%i part%s",
 	       n_basename(filedata->filename->data),
@@ -337,7 +364,7 @@ void ui_posting_file_start(newspost_data *data, file_entry *filedata) {
 		if (data->uuenc == TRUE)
 			estimate = filedata->fileinfo.st_size
 				   * UU_CHARACTERS_PER_LINE
-				   / BYTES_PER_LINE;
+				   / UU_BYTES_PER_LINE;
 		else
 			if (number_of_parts == 1)
 				estimate = bytes_in_first_part;
@@ -347,8 +374,8 @@ void ui_posting_file_start(newspost_data *data, file_entry *filedata) {
 					(number_of_parts - 1) +
 					/* ratio of last/normal partsize */
 					(( (double)(filedata->fileinfo.st_size
-					% (BYTES_PER_LINE * data->lines))
-					/ (BYTES_PER_LINE * data->lines))
+					% get_part_size(data))
+					/ get_part_size(data))
 					/* and multiply by (normal partsize) */
 					* bytes_in_first_part);
 
@@ -397,8 +424,6 @@ void ui_posting_file_start(newspost_data *data, file_entry *filedata) {
 	}
 	printf("\n");
 	fflush(stdout);
-
-	free(data_buffer);
 }
 
 void ui_posting_file_done(newspost_data *data, file_entry *filedata) {
@@ -447,8 +472,16 @@ void ui_nntp_posting_failed(newspost_threadinfo *tinfo, const char *response) {
 		"\n(Thread %d) WARNING: Posting failed: %s", tinfo->thread_id, response);
 }
 
+/* when a connection breaks with an article on it */
+void ui_posting_part_lost(file_entry *filedata, int part_number) {
+	fprintf(stderr,
+		"\nWARNING: Part %d/%d of %s could not be posted\n",
+		part_number, filedata->number_enc_parts,
+		n_basename(filedata->filename->data));
+}
+
 void ui_nntp_posting_retry(newspost_threadinfo *tinfo) {
-	fprintf(stderr, "(Thread %d) Trying to post it again...", tinfo->thread_id);
+	fprintf(stderr, "\n(Thread %d) Trying to post it again...", tinfo->thread_id);
 }
 
 void ui_post_done() {
@@ -486,6 +519,46 @@ void ui_post_done() {
 	free(progress_lock);
 }
 
+void ui_bandwidth_changed(long bandwidth, long burst) {
+	if (bandwidth > 0) {
+		printf("\nBandwidth limited to %s/second",
+		       byte_print(bandwidth));
+		printf(", in bursts of %s\n", byte_print(burst));
+	}
+	else
+		printf("\nBandwidth no longer limited\n");
+	fflush(stdout);
+}
+
+void ui_server_posted(const char *servername, int port, int articles,
+		      long bytes) {
+	printf("\n%s port %i: %i article%s, %s", servername, port,
+	       articles, plural(articles), byte_print(bytes));
+	fflush(stdout);
+}
+
+/* what went out from a local address given with -I, and how fast */
+void ui_source_posted(const char *address, int articles, long bytes) {
+	struct timeval current_time;
+	double bps = 0.0, msecs_passed;
+
+	gettimeofday(&current_time, NULL);
+	msecs_passed = (current_time.tv_sec - start_time.tv_sec) * 1000 +
+		(current_time.tv_usec - start_time.tv_usec) / 1000.0;
+	if (msecs_passed > 0)
+		bps = (1000.0 * bytes) / msecs_passed;
+
+	printf("\nfrom %s: %i article%s, %s, ", address, articles,
+	       plural(articles), byte_print(bytes));
+	if (bps > 1048576)
+		printf("%.2lf MB/second", (double) bps / 1048576);
+	else if (bps > 1024)
+		printf("%li KB/second", (long) bps / 1024);
+	else
+		printf("%li bytes/second", (long) bps);
+	fflush(stdout);
+}
+
 void ui_generic_error(int error) {
 	if (error != 0)
 		fprintf(stderr,
@@ -504,6 +577,16 @@ void ui_socket_error(int error){
 	fprintf(stderr, "\nSocket error: %s",strerror(error));
 }
 
+void ui_tls_error(const char *reason){
+	fprintf(stderr, "\nTLS error: %s",
+		(reason != NULL) ? reason : "unknown");
+}
+
+void ui_tls_refused(newspost_threadinfo *tinfo, const char *address) {
+	fprintf(stderr, "\n(Thread %d) TLS with %s can't work out."
+		" Giving up on it...\n", tinfo->thread_id, address);
+}
+
 /**
 *** Private Routines
 **/
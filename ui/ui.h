@@ -32,6 +32,9 @@ void ui_post_start(newspost_data *data, SList *file_list, SList *parfiles);
 void ui_socket_connect_start(newspost_threadinfo *tinfo, const char *servername);
 void ui_socket_connect_failed(newspost_threadinfo *tinfo, int retval);
 void ui_socket_connect_done(newspost_threadinfo *tinfo);
+void ui_socket_stalled(newspost_threadinfo *tinfo, int seconds);
+void ui_socket_bind_failed(const char *address);
+void ui_tls_started(newspost_threadinfo *tinfo, boolean kernel);
 
 void ui_nntp_logon_start(newspost_threadinfo *tinfo, const char *servername);
 void ui_nntp_logon_done(newspost_threadinfo *tinfo);
@@ -40,7 +43,8 @@ void ui_nntp_command_issued(newspost_threadinfo *tinfo, const char *command);
 void ui_nntp_server_response(newspost_threadinfo *tinfo, const char *response);
 void ui_nntp_unknown_response(newspost_threadinfo *tinfo, const char *response);
 
-void ui_posting_file_start(newspost_data *data, file_entry *filedata);
+void ui_posting_file_start(newspost_data *data, file_entry *filedata,
+			   long bytes_in_first_part);
 void ui_posting_file_done(newspost_data *data, file_entry *filedata);
 
 int ui_chunk_posted(newspost_threadinfo *tinfo, long chunksize, long bytes_written);
@@ -50,8 +54,14 @@ void ui_posting_part_start(newspost_threadinfo *tinfo, file_entry *filedata, int
 void ui_posting_part_done(newspost_threadinfo *tinfo, file_entry *filedata, int part_number);
 
 void ui_nntp_posting_failed(newspost_threadinfo *tinfo, const char *response);
+void ui_posting_part_lost(file_entry *filedata, int part_number);
 void ui_nntp_posting_retry(newspost_threadinfo *tinfo);
 
+void ui_bandwidth_changed(long bandwidth, long burst);
+void ui_server_posted(const char *servername, int port, int articles,
+		      long bytes);
+void ui_source_posted(const char *address, int articles, long bytes);
+
 void ui_post_done();
 
 void ui_generic_error(int error);
@@ -60,5 +70,7 @@ void ui_posting_too_many_failures(newspost_threadinfo *tinfo);
 void ui_connecting_too_many_failures(newspost_threadinfo *tinfo);
 
 void ui_socket_error(int error);
+void ui_tls_error(const char *reason);
+void ui_tls_refused(newspost_threadinfo *tinfo, const char *address);
 
 #endif /* __UI_H__ */